@@ -0,0 +1,117 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+
+#include "bmp_decoder.h"
+
+namespace {
+  // BMP headers are little-endian whatever the host byte order is.
+  uint32_t ReadLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  uint16_t ReadLE16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+  }
+
+  const uint32_t kCompressionNone = 0;  // BI_RGB
+}
+
+const size_t BmpDecoder::kHeaderSize;
+const int32_t BmpDecoder::kBytesPerPixel;
+
+BmpDecoder::BmpDecoder()
+: data_(NULL),
+  width_(0),
+  height_(0),
+  pixel_offset_(0),
+  stride_(0),
+  stored_rows_(0),
+  top_down_(false) {}
+
+bool BmpDecoder::ParseHeader(const uint8_t* bytes, size_t size,
+    Header* header) {
+  if (bytes == NULL || size < kHeaderSize)
+    return false;
+  if (bytes[0] != 'B' || bytes[1] != 'M')
+    return false;
+
+  uint32_t pixel_offset = ReadLE32(bytes + 10);
+  int32_t width = static_cast<int32_t>(ReadLE32(bytes + 18));
+  int32_t height = static_cast<int32_t>(ReadLE32(bytes + 22));
+  uint16_t bits_per_pixel = ReadLE16(bytes + 28);
+  uint32_t compression = ReadLE32(bytes + 30);
+  if (bits_per_pixel != kBytesPerPixel * 8 || compression != kCompressionNone)
+    return false;
+
+  // A negative height marks a top-down bitmap.
+  bool top_down = height < 0;
+  if (top_down)
+    height = -height;
+  if (width <= 0 || height <= 0)
+    return false;
+
+  header->pixel_offset = pixel_offset;
+  header->width = width;
+  header->height = height;
+  header->top_down = top_down;
+  return true;
+}
+
+bool BmpDecoder::ReadSize(const char* data, size_t size,
+    int32_t* width, int32_t* height) {
+  Header header;
+  if (!ParseHeader(reinterpret_cast<const uint8_t*>(data), size, &header))
+    return false;
+  *width = header.width;
+  *height = header.height;
+  return true;
+}
+
+bool BmpDecoder::Parse(const char* data, size_t size) {
+  return ParseRows(data, size, false);
+}
+
+bool BmpDecoder::ParsePartial(const char* data, size_t size) {
+  return ParseRows(data, size, true);
+}
+
+bool BmpDecoder::ParseRows(const char* data, size_t size,
+    bool allow_partial) {
+  data_ = NULL;
+  stored_rows_ = 0;
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  Header header;
+  if (!ParseHeader(bytes, size, &header))
+    return false;
+
+  // Every row is padded to a multiple of 4 bytes.
+  uint64_t stride =
+    (static_cast<uint64_t>(header.width) * kBytesPerPixel + 3) & ~3ULL;
+  if (header.pixel_offset > size)
+    return false;
+  uint64_t rows = (size - header.pixel_offset) / stride;
+  if (rows < static_cast<uint64_t>(header.height) && !allow_partial)
+    return false;
+
+  data_ = bytes;
+  width_ = header.width;
+  height_ = header.height;
+  pixel_offset_ = header.pixel_offset;
+  stride_ = static_cast<uint32_t>(stride);
+  stored_rows_ = static_cast<int32_t>(
+      std::min(rows, static_cast<uint64_t>(header.height)));
+  top_down_ = header.top_down;
+  return true;
+}
+
+const uint8_t* BmpDecoder::GetRow(int32_t y) const {
+  if (!data_ || y < 0 || y >= height_)
+    return NULL;
+  int32_t stored_row = top_down_ ? y : height_ - 1 - y;
+  if (stored_row >= stored_rows_)
+    return NULL;
+  return data_ + StoredRowOffset(stored_row);
+}
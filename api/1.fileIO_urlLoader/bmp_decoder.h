@@ -0,0 +1,93 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BMP_DECODER_H_
+#define BMP_DECODER_H_
+
+#include <stddef.h>
+#include "ppapi/c/pp_stdint.h"
+
+// BmpDecoder reads an uncompressed 24-bit Windows bitmap straight out of the
+// bytes it was loaded into.  The file and info headers are parsed once by
+// Parse(); after that GetRow() hands out pointers into the original buffer, so
+// no per-byte copy of the file is ever made.
+//
+// The decoder does not own the bytes.  The caller must keep them alive (and
+// unmodified) for as long as rows are being read.
+//
+// EXAMPLE USAGE:
+// BmpDecoder bmp;
+// if (bmp.Parse(&filedata[0], filedata.size())) {
+//   for (int32_t y = 0; y < bmp.height(); ++y)
+//     Consume(bmp.GetRow(y), bmp.width());  // B, G, R, B, G, R, ...
+// }
+//
+class BmpDecoder {
+  public:
+    // Size of BITMAPFILEHEADER plus the mandatory part of BITMAPINFOHEADER.
+    static const size_t kHeaderSize = 54;
+    // Only 24 bits per pixel (B, G, R) images are supported.
+    static const int32_t kBytesPerPixel = 3;
+
+    BmpDecoder();
+
+    // Parses the headers of the bitmap held in |data|.  Returns false (and
+    // leaves the decoder invalid) if the data is not a BMP this decoder
+    // understands or if it is too short to hold all of its rows.
+    bool Parse(const char* data, size_t size);
+
+    // Like Parse(), but accepts a bitmap whose last rows are still missing,
+    // as happens while it is downloaded.  stored_rows() tells how many rows
+    // have arrived.  Call it again on the longer data as more bytes come in.
+    bool ParsePartial(const char* data, size_t size);
+
+    // Reads the dimensions of a bitmap from its first |size| bytes, which
+    // need to cover kHeaderSize bytes only.  Used to lay images out before
+    // their pixels are loaded.
+    static bool ReadSize(const char* data, size_t size,
+        int32_t* width, int32_t* height);
+
+    bool is_valid() const { return data_ != NULL; }
+    int32_t width() const { return width_; }
+    int32_t height() const { return height_; }
+
+    // Number of rows present in the data, in file order: most bitmaps store
+    // the bottom row first, top_down() ones the top row.
+    int32_t stored_rows() const { return stored_rows_; }
+    bool top_down() const { return top_down_; }
+
+    // Returns the first pixel of row |y|, counted from the top of the image
+    // whatever the row order in the file is.  Pixels are stored as B, G, R.
+    // Returns NULL for rows that have not arrived.
+    const uint8_t* GetRow(int32_t y) const;
+
+    // Offset in the data of the first pixel of stored row |stored_row|, for
+    // callers that receive the bytes out of order.  The row takes
+    // width() * kBytesPerPixel bytes from there.
+    size_t StoredRowOffset(int32_t stored_row) const {
+      return pixel_offset_ + static_cast<size_t>(stored_row) * stride_;
+    }
+
+  private:
+    // Fields of the file and info headers this decoder needs.
+    struct Header {
+      uint32_t pixel_offset;
+      int32_t width;
+      int32_t height;
+      bool top_down;
+    };
+
+    static bool ParseHeader(const uint8_t* bytes, size_t size, Header* header);
+    bool ParseRows(const char* data, size_t size, bool allow_partial);
+
+    const uint8_t* data_;
+    int32_t width_;
+    int32_t height_;
+    uint32_t pixel_offset_;  // Offset of the first stored row.
+    uint32_t stride_;        // Row size in bytes, padded to 4 bytes.
+    int32_t stored_rows_;    // Rows present in the data.
+    bool top_down_;          // True if the first stored row is the top one.
+};
+
+#endif  // BMP_DECODER_H_
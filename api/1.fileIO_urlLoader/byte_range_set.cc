@@ -0,0 +1,96 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+
+#include "byte_range_set.h"
+
+ByteRangeSet::ByteRangeSet() {}
+
+void ByteRangeSet::Add(int64_t begin, int64_t end) {
+  if (begin >= end)
+    return;
+  // First range that ends at or after |begin|: everything before it is left
+  // alone, and it and the ones after that start at or before |end| merge.
+  size_t first = 0;
+  while (first < ranges_.size() && ranges_[first].end < begin)
+    ++first;
+  size_t last = first;
+  while (last < ranges_.size() && ranges_[last].begin <= end) {
+    begin = std::min(begin, ranges_[last].begin);
+    end = std::max(end, ranges_[last].end);
+    ++last;
+  }
+  Range range = { begin, end };
+  ranges_.erase(ranges_.begin() + first, ranges_.begin() + last);
+  ranges_.insert(ranges_.begin() + first, range);
+}
+
+bool ByteRangeSet::Contains(int64_t begin, int64_t end) const {
+  if (begin >= end)
+    return true;
+  Range range = RangeAt(begin);
+  return range.end >= end;
+}
+
+ByteRangeSet::Range ByteRangeSet::RangeAt(int64_t offset) const {
+  for (size_t i = 0; i < ranges_.size(); ++i) {
+    if (ranges_[i].begin <= offset && offset < ranges_[i].end)
+      return ranges_[i];
+  }
+  Range empty = { offset, offset };
+  return empty;
+}
+
+int64_t ByteRangeSet::size() const {
+  int64_t total = 0;
+  for (size_t i = 0; i < ranges_.size(); ++i)
+    total += ranges_[i].end - ranges_[i].begin;
+  return total;
+}
+
+std::vector<ByteRangeSet::Range> ByteRangeSet::Missing(int64_t total) const {
+  std::vector<Range> missing;
+  int64_t next = 0;
+  for (size_t i = 0; i < ranges_.size() && next < total; ++i) {
+    if (ranges_[i].begin > next) {
+      Range gap = { next, std::min(ranges_[i].begin, total) };
+      missing.push_back(gap);
+    }
+    next = std::max(next, ranges_[i].end);
+  }
+  if (next < total) {
+    Range gap = { next, total };
+    missing.push_back(gap);
+  }
+  return missing;
+}
+
+std::string ByteRangeSet::Serialize() const {
+  std::stringstream ss;
+  for (size_t i = 0; i < ranges_.size(); ++i)
+    ss << ranges_[i].begin << ' ' << ranges_[i].end << '\n';
+  return ss.str();
+}
+
+bool ByteRangeSet::Parse(const std::string& text) {
+  ranges_.clear();
+  std::stringstream ss(text);
+  int64_t begin;
+  int64_t end;
+  while (ss >> begin >> end) {
+    if (begin < 0 || begin >= end) {
+      ranges_.clear();
+      return false;
+    }
+    Add(begin, end);
+  }
+  if (!ss.eof()) {
+    ranges_.clear();
+    return false;
+  }
+  return true;
+}
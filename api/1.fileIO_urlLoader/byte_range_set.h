@@ -0,0 +1,59 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BYTE_RANGE_SET_H_
+#define BYTE_RANGE_SET_H_
+
+#include <string>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+
+// ByteRangeSet records which bytes of a file are present as a sorted list of
+// disjoint [begin, end) ranges.  Downloads fetched in several pieces use it
+// to know what has arrived and what is still missing.
+//
+// EXAMPLE USAGE:
+// ByteRangeSet received;
+// received.Add(0, 100);
+// received.Add(200, 300);
+// received.Missing(300);  // [100, 200)
+//
+class ByteRangeSet {
+  public:
+    struct Range {
+      int64_t begin;
+      int64_t end;
+    };
+
+    ByteRangeSet();
+
+    void Clear() { ranges_.clear(); }
+    bool empty() const { return ranges_.empty(); }
+    const std::vector<Range>& ranges() const { return ranges_; }
+
+    // Adds [begin, end), merging it with the ranges it touches.
+    void Add(int64_t begin, int64_t end);
+
+    // True if every byte of [begin, end) is present.
+    bool Contains(int64_t begin, int64_t end) const;
+
+    // The present range holding |offset|, or an empty one at |offset|.
+    Range RangeAt(int64_t offset) const;
+
+    // Number of bytes present.
+    int64_t size() const;
+
+    // The ranges of [0, total) that are not present.
+    std::vector<Range> Missing(int64_t total) const;
+
+    // One "begin end" pair per line, and back.  Parse() returns false (and
+    // leaves the set empty) on malformed text.
+    std::string Serialize() const;
+    bool Parse(const std::string& text);
+
+  private:
+    std::vector<Range> ranges_;
+};
+
+#endif  // BYTE_RANGE_SET_H_
@@ -0,0 +1,34 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+
+#include "canvas_layout.h"
+
+CanvasLayout::CanvasLayout(int32_t margin, int32_t max_row_width)
+: margin_(margin),
+  max_row_width_(max_row_width),
+  cursor_x_(margin),
+  row_y_(margin),
+  row_height_(0) {}
+
+size_t CanvasLayout::Add(const pp::Size& size) {
+  // Wrap to a new row, unless the image is the first of its row (an image
+  // wider than the limit still gets a row of its own).
+  if (cursor_x_ > margin_ &&
+      cursor_x_ + size.width() + margin_ > max_row_width_) {
+    row_y_ += row_height_ + margin_;
+    cursor_x_ = margin_;
+    row_height_ = 0;
+  }
+  pp::Rect slot(cursor_x_, row_y_, size.width(), size.height());
+  slots_.push_back(slot);
+
+  cursor_x_ += size.width() + margin_;
+  row_height_ = std::max(row_height_, size.height());
+  canvas_size_.set_width(std::max(canvas_size_.width(), cursor_x_));
+  canvas_size_.set_height(
+      std::max(canvas_size_.height(), row_y_ + row_height_ + margin_));
+  return slots_.size() - 1;
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CANVAS_LAYOUT_H_
+#define CANVAS_LAYOUT_H_
+
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/rect.h"
+#include "ppapi/cpp/size.h"
+
+// CanvasLayout places images left to right with a fixed margin around them,
+// starting a new row when the next image would make a row wider than
+// |max_row_width|.  Images are added by size only (measured from their
+// headers), so the canvas can be allocated at its final size before any
+// pixel is decoded.
+//
+// EXAMPLE USAGE:
+// CanvasLayout layout(10, 3000);
+// size_t slot = layout.Add(pp::Size(300, 300));
+// CreateCanvas(layout.canvas_size());
+// Draw(image, layout.slot(slot).point());
+//
+class CanvasLayout {
+  public:
+    CanvasLayout(int32_t margin, int32_t max_row_width);
+
+    // Reserves a slot for an image of |size| and returns its index.
+    size_t Add(const pp::Size& size);
+
+    size_t slot_count() const { return slots_.size(); }
+    const pp::Rect& slot(size_t index) const { return slots_[index]; }
+
+    // Smallest canvas holding every slot and the margin around them.
+    const pp::Size& canvas_size() const { return canvas_size_; }
+
+  private:
+    int32_t margin_;
+    int32_t max_row_width_;
+    std::vector<pp::Rect> slots_;
+    int32_t cursor_x_;    // Left edge of the next slot in the current row.
+    int32_t row_y_;       // Top edge of the current row.
+    int32_t row_height_;  // Height of the tallest slot in the current row.
+    pp::Size canvas_size_;
+};
+
+#endif  // CANVAS_LAYOUT_H_
@@ -0,0 +1,73 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "dirty_region.h"
+
+namespace {
+  int64_t Area(const pp::Rect& rect) {
+    return static_cast<int64_t>(rect.width()) * rect.height();
+  }
+
+  // True if |a| and |b| overlap, or touch so that their bounding box holds
+  // no pixel outside of them.
+  bool ShouldMerge(const pp::Rect& a, const pp::Rect& b) {
+    if (a.Intersects(b))
+      return true;
+    return Area(a.Union(b)) == Area(a) + Area(b);
+  }
+}
+
+const size_t DirtyRegion::kMaxRects;
+
+DirtyRegion::DirtyRegion() {}
+
+void DirtyRegion::Add(const pp::Rect& rect) {
+  if (rect.IsEmpty())
+    return;
+  pp::Rect merged = rect;
+  // A merged rectangle may reach rectangles it did not touch before, so keep
+  // going until it touches none.
+  size_t i = 0;
+  while (i < rects_.size()) {
+    if (rects_[i].Contains(merged))
+      return;
+    if (ShouldMerge(rects_[i], merged)) {
+      merged = merged.Union(rects_[i]);
+      rects_.erase(rects_.begin() + i);
+      i = 0;
+    } else {
+      ++i;
+    }
+  }
+  rects_.push_back(merged);
+  if (rects_.size() > kMaxRects)
+    MergeClosestPair();
+}
+
+void DirtyRegion::Add(const DirtyRegion& other) {
+  for (size_t i = 0; i < other.rects_.size(); ++i)
+    Add(other.rects_[i]);
+}
+
+void DirtyRegion::MergeClosestPair() {
+  size_t best_a = 0;
+  size_t best_b = 1;
+  int64_t best_waste = -1;
+  for (size_t a = 0; a < rects_.size(); ++a) {
+    for (size_t b = a + 1; b < rects_.size(); ++b) {
+      int64_t waste = Area(rects_[a].Union(rects_[b])) -
+        Area(rects_[a]) - Area(rects_[b]);
+      if (best_waste < 0 || waste < best_waste) {
+        best_waste = waste;
+        best_a = a;
+        best_b = b;
+      }
+    }
+  }
+  pp::Rect merged = rects_[best_a].Union(rects_[best_b]);
+  rects_.erase(rects_.begin() + best_b);
+  rects_.erase(rects_.begin() + best_a);
+  // Re-adding merges whatever the bounding box now overlaps.
+  Add(merged);
+}
@@ -0,0 +1,52 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DIRTY_REGION_H_
+#define DIRTY_REGION_H_
+
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/rect.h"
+
+// DirtyRegion collects the rectangles that changed between two frames as a
+// small set of disjoint rectangles, so a repaint touches each changed pixel
+// once however many draw calls produced it.
+//
+// Overlapping (or edge-sharing) rectangles are merged as they are added.
+// When more than kMaxRects are left, the two whose bounding box wastes the
+// fewest unchanged pixels are merged, which keeps the set small without
+// falling back to one rectangle around everything.
+//
+// EXAMPLE USAGE:
+// DirtyRegion dirty;
+// dirty.Add(pp::Rect(0, 0, 10, 10));
+// dirty.Add(pp::Rect(5, 5, 10, 10));  // Merged with the first one.
+// for (size_t i = 0; i < dirty.rect_count(); ++i)
+//   Repaint(dirty.rect(i));
+//
+class DirtyRegion {
+  public:
+    static const size_t kMaxRects = 8;
+
+    DirtyRegion();
+
+    void Clear() { rects_.clear(); }
+    bool IsEmpty() const { return rects_.empty(); }
+
+    size_t rect_count() const { return rects_.size(); }
+    const pp::Rect& rect(size_t index) const { return rects_[index]; }
+
+    // Adds |rect| to the region.  Empty rectangles are ignored.
+    void Add(const pp::Rect& rect);
+
+    // Adds all the rectangles of |other|.
+    void Add(const DirtyRegion& other);
+
+  private:
+    void MergeClosestPair();
+
+    std::vector<pp::Rect> rects_;
+};
+
+#endif  // DIRTY_REGION_H_
@@ -0,0 +1,436 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <sstream>
+
+#include "ppapi/c/pp_errors.h"
+#include "ppapi/c/ppb_file_io.h"
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/file_ref.h"
+#include "ppapi/cpp/module.h"
+
+#include "download_file_writer.h"
+
+namespace {
+  // The journal is brought up to date once this much has been written since
+  // it last was, or this long has passed, and when the download stops.
+  // Each update flushes the file first, so it costs a few blocking calls.
+  const int64_t kJournalIntervalBytes = 4 * 1024 * 1024;
+  const double kJournalIntervalSeconds = 2.0;
+
+  double Now() {
+    return pp::Module::Get()->core()->GetTimeTicks();
+  }
+}
+
+// Work waiting for the file_queue_.  Holds a reference to its writer.
+struct DownloadFileWriter::Task {
+  enum Kind {
+    kWrite,
+    kFinish,
+    kLoadJournal,
+    kStartJournal,
+    kRestart,
+    kLoadValidators,
+    kSaveValidators
+  };
+
+  explicit Task(Kind task_kind)
+  : writer(NULL), kind(task_kind), offset(0), total(-1), journal(NULL),
+    validators(NULL) {}
+
+  // False for the tasks nobody waits for.
+  bool has_done() const {
+    return kind != kStartJournal && kind != kRestart &&
+      kind != kSaveValidators;
+  }
+
+  DownloadFileWriter* writer;
+  Kind kind;
+  int64_t offset;
+  std::vector<char> bytes;
+  std::string url;
+  int64_t total;
+  Journal* journal;
+  Validators* validators;       // Owned by kStartJournal, kSaveValidators.
+  pp::CompletionCallback done;  // Only used if has_done().
+};
+
+DownloadFileWriter::DownloadFileWriter(const pp::InstanceHandle& instance,
+    const pp::FileSystem& file_system, FileWorkQueue* file_queue,
+    const std::string& path, bool truncate)
+: ref_count_(1),
+  instance_(instance),
+  file_system_(file_system),
+  file_queue_(file_queue),
+  path_(path),
+  truncate_(truncate),
+  opened_(false),
+  error_(PP_OK),
+  journal_enabled_(false),
+  journal_total_(-1),
+  unjournaled_bytes_(0),
+  journal_time_(0),
+  validators_deleted_(false) {}
+
+DownloadFileWriter::~DownloadFileWriter() {}
+
+void DownloadFileWriter::AddRef() {
+  __sync_fetch_and_add(&ref_count_, 1);
+}
+
+void DownloadFileWriter::Release() {
+  if (__sync_sub_and_fetch(&ref_count_, 1) == 0)
+    delete this;
+}
+
+void DownloadFileWriter::Write(int64_t offset, const char* data,
+    int32_t size, const pp::CompletionCallback& done) {
+  Task* task = new Task(Task::kWrite);
+  task->offset = offset;
+  task->bytes.assign(data, data + size);
+  task->done = done;
+  Post(task);
+}
+
+void DownloadFileWriter::Finish(const pp::CompletionCallback& done) {
+  Task* task = new Task(Task::kFinish);
+  task->done = done;
+  Post(task);
+}
+
+void DownloadFileWriter::LoadJournal(const std::string& url,
+    Journal* journal, const pp::CompletionCallback& done) {
+  Task* task = new Task(Task::kLoadJournal);
+  task->url = url;
+  task->journal = journal;
+  task->done = done;
+  Post(task);
+}
+
+void DownloadFileWriter::StartJournal(const std::string& url, int64_t total,
+    const Validators& validators) {
+  Task* task = new Task(Task::kStartJournal);
+  task->url = url;
+  task->total = total;
+  task->validators = new Validators(validators);
+  Post(task);
+}
+
+void DownloadFileWriter::Restart() {
+  Post(new Task(Task::kRestart));
+}
+
+void DownloadFileWriter::LoadValidators(const std::string& url,
+    Validators* validators, const pp::CompletionCallback& done) {
+  Task* task = new Task(Task::kLoadValidators);
+  task->url = url;
+  task->validators = validators;
+  task->done = done;
+  Post(task);
+}
+
+void DownloadFileWriter::SaveValidators(const std::string& url,
+    const Validators& validators) {
+  Task* task = new Task(Task::kSaveValidators);
+  task->url = url;
+  task->validators = new Validators(validators);
+  Post(task);
+}
+
+void DownloadFileWriter::Post(Task* task) {
+  AddRef();
+  task->writer = this;
+  // The data is not waited for; what a download waits for to start is.
+  FileWorkQueue::Priority priority =
+    task->kind == Task::kLoadJournal || task->kind == Task::kLoadValidators ?
+    FileWorkQueue::kPriorityNormal : FileWorkQueue::kPriorityBulk;
+  int32_t result = file_queue_->PostWork(path_, priority,
+      pp::CompletionCallback(&DownloadFileWriter::RunTask, task));
+  if (result != PP_OK) {
+    // The file threads are gone; nothing will ever be written.
+    if (task->has_done())
+      pp::Module::Get()->core()->CallOnMainThread(0, task->done, result);
+    if (task->kind == Task::kStartJournal ||
+        task->kind == Task::kSaveValidators)
+      delete task->validators;
+    delete task;
+    Release();
+  }
+}
+
+// static
+void DownloadFileWriter::RunTask(void* user_data, int32_t /* result */) {
+  Task* task = static_cast<Task*>(user_data);
+  DownloadFileWriter* writer = task->writer;
+  int32_t result = PP_OK;
+  switch (task->kind) {
+    case Task::kWrite:
+      // After an error the rest of the download is useless; drop it.
+      if (writer->error_ == PP_OK)
+        writer->error_ = writer->WriteChunk(*task);
+      result = writer->error_;
+      break;
+    case Task::kFinish: {
+      // An empty download still leaves an (empty) file behind.
+      result = writer->error_;
+      if (result == PP_OK)
+        result = writer->EnsureOpen();
+      // Flushed after a failed write too, so the journal keeps what did get
+      // written for the next attempt.
+      const int32_t flushed = writer->opened_ ?
+        writer->file_.Flush(pp::BlockUntilComplete()) : PP_ERROR_FAILED;
+      if (result == PP_OK)
+        result = flushed;
+      writer->file_.Close();
+      writer->opened_ = false;
+      if (writer->journal_enabled_ && result == PP_OK &&
+          writer->journal_total_ >= 0 &&
+          writer->written_.Contains(0, writer->journal_total_))
+        writer->DeleteJournal();
+      else if (flushed == PP_OK)
+        writer->SaveJournal();
+      if (!writer->journal_file_.is_null()) {
+        writer->journal_file_.Close();
+        writer->journal_file_ = pp::FileIO();
+      }
+      break;
+    }
+    case Task::kLoadJournal:
+      writer->ReadJournal(task->url, task->journal);
+      break;
+    case Task::kStartJournal:
+      writer->journal_enabled_ = true;
+      writer->journal_url_ = task->url;
+      writer->journal_total_ = task->total;
+      writer->journal_validators_ = *task->validators;
+      writer->SaveJournal();
+      delete task->validators;
+      break;
+    case Task::kRestart:
+      // The next write opens the file again, and empties it.
+      writer->file_.Close();
+      writer->opened_ = false;
+      writer->truncate_ = true;
+      writer->error_ = PP_OK;
+      writer->written_.Clear();
+      writer->DeleteJournal();
+      break;
+    case Task::kLoadValidators:
+      writer->ReadValidators(task->url, task->validators);
+      break;
+    case Task::kSaveValidators:
+      if (writer->error_ == PP_OK)
+        writer->WriteValidators(task->url, *task->validators);
+      delete task->validators;
+      break;
+  }
+  if (task->has_done())
+    pp::Module::Get()->core()->CallOnMainThread(0, task->done, result);
+  delete task;
+  writer->Release();
+}
+
+int32_t DownloadFileWriter::EnsureOpen() {
+  if (opened_)
+    return PP_OK;
+  if (!validators_deleted_) {
+    // The file is about to change; its old validators no longer hold.
+    pp::FileRef(file_system_, validators_path().c_str()).Delete(
+        pp::BlockUntilComplete());
+    validators_deleted_ = true;
+  }
+  pp::FileRef ref(file_system_, path_.c_str());
+  file_ = pp::FileIO(instance_);
+  int32_t flags = PP_FILEOPENFLAG_WRITE | PP_FILEOPENFLAG_CREATE;
+  if (truncate_)
+    flags |= PP_FILEOPENFLAG_TRUNCATE;
+  int32_t result = file_.Open(ref, flags, pp::BlockUntilComplete());
+  if (result != PP_OK)
+    return result;
+  opened_ = true;
+  // Finish() closes the file; later writes (of another segment) go on.
+  truncate_ = false;
+  return PP_OK;
+}
+
+int32_t DownloadFileWriter::WriteChunk(const Task& task) {
+  int32_t result = EnsureOpen();
+  if (result != PP_OK)
+    return result;
+  const int32_t size = static_cast<int32_t>(task.bytes.size());
+  int32_t written = 0;
+  while (written < size) {
+    int32_t bytes = file_.Write(task.offset + written,
+        &task.bytes[written], size - written, pp::BlockUntilComplete());
+    if (bytes <= 0)
+      return bytes < 0 ? bytes : PP_ERROR_FAILED;
+    written += bytes;
+  }
+  written_.Add(task.offset, task.offset + size);
+  unjournaled_bytes_ += size;
+  if (journal_enabled_ && (unjournaled_bytes_ >= kJournalIntervalBytes ||
+        Now() - journal_time_ >= kJournalIntervalSeconds)) {
+    // The journal must not list bytes that may not be on disk yet.
+    result = file_.Flush(pp::BlockUntilComplete());
+    if (result != PP_OK)
+      return result;
+    SaveJournal();
+  }
+  return PP_OK;
+}
+
+bool DownloadFileWriter::ReadSmallFile(const std::string& path,
+    std::string* text) {
+  pp::FileRef ref(file_system_, path.c_str());
+  pp::FileIO file(instance_);
+  if (file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete()) != PP_OK)
+    return false;
+  PP_FileInfo info;
+  if (file.Query(&info, pp::BlockUntilComplete()) != PP_OK ||
+      info.size <= 0 || info.size > 1024 * 1024)
+    return false;
+  text->assign(static_cast<size_t>(info.size), '\0');
+  int32_t offset = 0;
+  while (offset < info.size) {
+    int32_t bytes = file.Read(offset, &(*text)[offset],
+        static_cast<int32_t>(info.size) - offset, pp::BlockUntilComplete());
+    if (bytes <= 0)
+      return false;
+    offset += bytes;
+  }
+  return true;
+}
+
+void DownloadFileWriter::ReadJournal(const std::string& url,
+    Journal* journal) {
+  std::string text;
+  if (!ReadSmallFile(journal_path(), &text))
+    return;
+
+  // "<url>\n<total>\n<ETag>\n<Last-Modified>\n" followed by the ranges
+  // written.
+  std::stringstream ss(text);
+  std::string journal_url;
+  std::string total;
+  Validators validators;
+  std::string ranges;
+  if (!std::getline(ss, journal_url) || !std::getline(ss, total) ||
+      !std::getline(ss, validators.etag) ||
+      !std::getline(ss, validators.last_modified) || journal_url != url)
+    return;
+  std::getline(ss, ranges, '\0');
+  ByteRangeSet written;
+  if (!written.Parse(ranges))
+    return;
+  journal->total = strtoll(total.c_str(), NULL, 10);
+  journal->written = written;
+  journal->validators = validators;
+  written_ = written;
+  truncate_ = false;
+}
+
+void DownloadFileWriter::SaveJournal() {
+  if (!journal_enabled_)
+    return;
+  unjournaled_bytes_ = 0;
+  journal_time_ = Now();
+  if (journal_file_.is_null()) {
+    pp::FileRef ref(file_system_, journal_path().c_str());
+    journal_file_ = pp::FileIO(instance_);
+    if (journal_file_.Open(ref,
+          PP_FILEOPENFLAG_WRITE | PP_FILEOPENFLAG_CREATE,
+          pp::BlockUntilComplete()) != PP_OK) {
+      // Without a journal the download can only start over; carry on.
+      journal_file_ = pp::FileIO();
+      journal_enabled_ = false;
+      return;
+    }
+  }
+  std::stringstream ss;
+  ss << journal_url_ << '\n' << journal_total_ << '\n'
+     << journal_validators_.etag << '\n'
+     << journal_validators_.last_modified << '\n' << written_.Serialize();
+  const std::string text = ss.str();
+  int32_t offset = 0;
+  while (offset < static_cast<int32_t>(text.size())) {
+    int32_t bytes = journal_file_.Write(offset, text.data() + offset,
+        text.size() - offset, pp::BlockUntilComplete());
+    if (bytes <= 0)
+      return;
+    offset += bytes;
+  }
+  journal_file_.SetLength(text.size(), pp::BlockUntilComplete());
+}
+
+void DownloadFileWriter::DeleteJournal() {
+  journal_file_.Close();
+  journal_file_ = pp::FileIO();
+  journal_enabled_ = false;
+  pp::FileRef ref(file_system_, journal_path().c_str());
+  ref.Delete(pp::BlockUntilComplete());
+}
+
+void DownloadFileWriter::ReadValidators(const std::string& url,
+    Validators* validators) {
+  std::string text;
+  if (!ReadSmallFile(validators_path(), &text))
+    return;
+
+  // "<url>\n<file size>\n<ETag>\n<Last-Modified>\n"
+  std::stringstream ss(text);
+  std::string saved_url;
+  std::string size;
+  Validators saved;
+  if (!std::getline(ss, saved_url) || !std::getline(ss, size) ||
+      !std::getline(ss, saved.etag) || !std::getline(ss, saved.last_modified) ||
+      saved_url != url)
+    return;
+
+  // The validators only stand for the file they were saved with.
+  pp::FileRef ref(file_system_, path_.c_str());
+  pp::FileIO file(instance_);
+  PP_FileInfo info;
+  if (file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete()) != PP_OK ||
+      file.Query(&info, pp::BlockUntilComplete()) != PP_OK ||
+      info.size != strtoll(size.c_str(), NULL, 10))
+    return;
+  *validators = saved;
+}
+
+void DownloadFileWriter::WriteValidators(const std::string& url,
+    const Validators& validators) {
+  pp::FileRef ref(file_system_, path_.c_str());
+  pp::FileIO file(instance_);
+  PP_FileInfo info;
+  if (file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete()) != PP_OK ||
+      file.Query(&info, pp::BlockUntilComplete()) != PP_OK)
+    return;
+  file.Close();
+
+  std::stringstream ss;
+  ss << url << '\n' << info.size << '\n' << validators.etag << '\n'
+     << validators.last_modified << '\n';
+  const std::string text = ss.str();
+  pp::FileRef meta_ref(file_system_, validators_path().c_str());
+  pp::FileIO meta(instance_);
+  if (meta.Open(meta_ref,
+        PP_FILEOPENFLAG_WRITE | PP_FILEOPENFLAG_CREATE | PP_FILEOPENFLAG_TRUNCATE,
+        pp::BlockUntilComplete()) != PP_OK)
+    return;
+  int32_t offset = 0;
+  while (offset < static_cast<int32_t>(text.size())) {
+    int32_t bytes = meta.Write(offset, text.data() + offset,
+        text.size() - offset, pp::BlockUntilComplete());
+    if (bytes <= 0) {
+      // A partial record would not parse; better none at all.
+      meta.Close();
+      meta_ref.Delete(pp::BlockUntilComplete());
+      return;
+    }
+    offset += bytes;
+  }
+  meta.Flush(pp::BlockUntilComplete());
+}
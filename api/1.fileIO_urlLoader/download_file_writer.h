@@ -0,0 +1,167 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DOWNLOAD_FILE_WRITER_H_
+#define DOWNLOAD_FILE_WRITER_H_
+
+#include <string>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/file_io.h"
+#include "ppapi/cpp/file_system.h"
+#include "ppapi/cpp/instance_handle.h"
+
+#include "byte_range_set.h"
+#include "file_work_queue.h"
+
+// DownloadFileWriter writes a download into a file of the html5 file system
+// while it arrives.  Chunks are queued from the main thread, written at their
+// offset by a FileWorkQueue (where blocking file calls are allowed), in order
+// with any other work on the same path, and reported back on the main
+// thread, so saving overlaps with the transfer.
+//
+// The writer is reference counted: every queued chunk holds a reference, so
+// whoever started a download may drop its own before the last write is done.
+// Every write reports back when it is done, so a producer can count what
+// it has queued and stop reading while the disk is behind, which keeps
+// memory bounded to a few chunks.
+//
+// A download that may be fetched in pieces keeps a journal next to the file
+// ("<path>.partial") listing the byte ranges already written, and the HTTP
+// validators of the version they came from.  It is updated every few MB or
+// seconds and by Finish(), each time after the file is flushed, so it only
+// lists bytes that are on disk.  If the download is interrupted,
+// LoadJournal() tells the next attempt what is left to fetch and which
+// version to ask for; the journal goes away once Finish() finds the file
+// complete, or Restart() starts the file over.
+//
+// The HTTP validators (ETag, Last-Modified) of a complete download can be
+// kept next to it as well ("<path>.meta"), so the next download of the same
+// URL can be made conditional.  They are dropped as soon as the file is
+// written to again.
+//
+// EXAMPLE USAGE:
+// DownloadFileWriter* writer = new DownloadFileWriter(instance, file_system,
+//     &file_queue, "/image.bmp", true);
+// writer->Write(0, buffer, size, factory.NewCallback(&Handler::OnWritten));
+// writer->Finish(factory.NewCallback(&Handler::OnSaved));
+// writer->Release();
+//
+class DownloadFileWriter {
+  public:
+    // What the server said identifies the version of a download.
+    struct Validators {
+      std::string etag;           // Empty if the server sent none.
+      std::string last_modified;  // Same.
+      bool empty() const { return etag.empty() && last_modified.empty(); }
+    };
+
+    // What an interrupted download left in the file.
+    struct Journal {
+      Journal() : total(-1) {}
+      int64_t total;          // Size of the complete file, or -1 if unknown.
+      ByteRangeSet written;   // Ranges already in the file.
+      Validators validators;  // Of the version the ranges came from.
+    };
+
+    // The new writer has one reference, owned by the caller.  The file is
+    // opened by the first write; it is emptied first if |truncate| is set.
+    DownloadFileWriter(const pp::InstanceHandle& instance,
+        const pp::FileSystem& file_system, FileWorkQueue* file_queue,
+        const std::string& path, bool truncate);
+
+    void AddRef();
+    void Release();
+
+    const std::string& path() const { return path_; }
+
+    // Copies |size| bytes at |data| and queues them to be written at
+    // |offset|.  |done| runs on the main thread with PP_OK or the error met.
+    void Write(int64_t offset, const char* data, int32_t size,
+        const pp::CompletionCallback& done);
+
+    // Reads the journal left by an interrupted download of |url| into
+    // |journal|, which must stay alive until |done| runs on the main thread.
+    // A journal of another URL counts as none.  If one is found, the file is
+    // continued instead of being truncated.
+    void LoadJournal(const std::string& url, Journal* journal,
+        const pp::CompletionCallback& done);
+
+    // Keeps a journal from now on, so the download of |url|, |total| bytes
+    // long and identified by |validators|, can be resumed.  Ranges found by
+    // LoadJournal() are kept.
+    void StartJournal(const std::string& url, int64_t total,
+        const Validators& validators);
+
+    // Starts the file over after the queued writes: the journal and what was
+    // written are dropped, and the next write empties the file.  Used when
+    // the resource turns out to have changed during the download.
+    void Restart();
+
+    // Reads the validators saved with the file for |url| into |validators|,
+    // which must stay alive until |done| runs on the main thread.  They are
+    // left empty if there are none, they are for another URL or the file
+    // has changed size since.
+    void LoadValidators(const std::string& url, Validators* validators,
+        const pp::CompletionCallback& done);
+
+    // Saves |validators| for |url| after the queued writes, unless one of
+    // them failed.  Call it once the download is complete.
+    void SaveValidators(const std::string& url, const Validators& validators);
+
+    // Flushes the data written so far.  |done| runs on the main thread after
+    // every queued write, with the first error met by any of them or PP_OK.
+    // More writes may follow, as when the segments of a download end one by
+    // one.
+    void Finish(const pp::CompletionCallback& done);
+
+  private:
+    struct Task;
+
+    ~DownloadFileWriter();
+
+    void Post(Task* task);
+    static void RunTask(void* user_data, int32_t result);
+    // Called on a file_queue_ thread.
+    int32_t EnsureOpen();
+    int32_t WriteChunk(const Task& task);
+    // Reads a file of at most 1 MB, such as a journal, into |text|.
+    bool ReadSmallFile(const std::string& path, std::string* text);
+    void ReadJournal(const std::string& url, Journal* journal);
+    // Records written_ in the journal; the file must have been flushed.
+    void SaveJournal();
+    void DeleteJournal();
+    void ReadValidators(const std::string& url, Validators* validators);
+    void WriteValidators(const std::string& url, const Validators& validators);
+    std::string journal_path() const { return path_ + ".partial"; }
+    std::string validators_path() const { return path_ + ".meta"; }
+
+    volatile int32_t ref_count_;
+    pp::InstanceHandle instance_;
+    pp::FileSystem file_system_;
+    FileWorkQueue* file_queue_;  // Outlives the writer.
+    std::string path_;
+    bool truncate_;
+
+    // Only used by the work of file_queue_.
+    pp::FileIO file_;
+    bool opened_;
+    int32_t error_;  // First error met, or PP_OK.
+    ByteRangeSet written_;
+    bool journal_enabled_;
+    std::string journal_url_;
+    int64_t journal_total_;
+    Validators journal_validators_;
+    pp::FileIO journal_file_;  // Open while the journal is kept.
+    // Written since the journal was last saved, and when that was.
+    int64_t unjournaled_bytes_;
+    double journal_time_;
+    bool validators_deleted_;  // The old "<path>.meta" is gone.
+
+    DownloadFileWriter(const DownloadFileWriter&);
+    void operator=(const DownloadFileWriter&);
+};
+
+#endif  // DOWNLOAD_FILE_WRITER_H_
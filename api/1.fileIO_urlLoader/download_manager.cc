@@ -0,0 +1,356 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+
+#include <sstream>
+
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/var_array.h"
+
+#include "download_file_writer.h"
+#include "download_manager.h"
+#include "segmented_download.h"
+
+namespace {
+  // Browsers keep about six connections per host; stay below that so the
+  // page itself is not starved.
+  const int kDefaultMaxPerOrigin = 4;
+  const int kDefaultMaxActive = 6;
+  // Least time between two PROGRESS messages of one download.
+  const double kProgressIntervalSeconds = 0.25;
+
+  double Now() {
+    return pp::Module::Get()->core()->GetTimeTicks();
+  }
+}
+
+// A queued or running download.  Forwards what its URLLoaderHandler reports
+// to the manager's listener and tells the manager when it is done.
+class DownloadManager::Job : public URLLoaderHandler::Listener {
+  public:
+    Job(DownloadManager* manager, const std::string& url,
+        const std::string& file_name, DownloadFileWriter* writer)
+    : manager_(manager),
+      url_(url),
+      file_name_(file_name),
+      origin_(DownloadManager::OriginOf(url)),
+      priority_(kPriorityNormal),
+      writer_(writer),
+      download_(NULL),
+      handler_(NULL),
+      request_time_(0),
+      first_byte_time_(-1),
+      bytes_(0),
+      resumed_bytes_(0),
+      total_bytes_(-1),
+      report_time_(0),
+      report_bytes_(0) {
+      if (writer_)
+        writer_->AddRef();
+    }
+
+    virtual ~Job() {
+      if (writer_)
+        writer_->Release();
+    }
+
+    const std::string& url() const { return url_; }
+    const std::string& file_name() const { return file_name_; }
+    const std::string& origin() const { return origin_; }
+    Priority priority() const { return priority_; }
+    void set_priority(Priority priority) { priority_ = priority; }
+
+    // Timing, in seconds of Now(); first_byte_time() is -1 until the body
+    // starts.
+    double request_time() const { return request_time_; }
+    double first_byte_time() const { return first_byte_time_; }
+    int64_t bytes() const { return bytes_; }
+    // Bytes of the file saved by an earlier attempt, not fetched again.
+    int64_t resumed_bytes() const { return resumed_bytes_; }
+    int64_t total_bytes() const { return total_bytes_; }
+    // The last PROGRESS message, to space them and to tell the recent speed.
+    double report_time() const { return report_time_; }
+    int64_t report_bytes() const { return report_bytes_; }
+    void set_reported(double time) {
+      report_time_ = time;
+      report_bytes_ = bytes_;
+    }
+
+    bool Start() {
+      request_time_ = Now();
+      report_time_ = request_time_;
+      if (writer_) {
+        // Fetched in ranges and resumable; reports back as one download.
+        download_ = new SegmentedDownload(
+            manager_->instance_, url_, file_name_, writer_, this);
+        download_->Start();
+        return true;
+      }
+      handler_ = URLLoaderHandler::Create(
+          manager_->instance_, url_, file_name_, this);
+      if (!handler_)
+        return false;
+      handler_->Start();
+      return true;
+    }
+
+    // Stops the running download; it reports nothing more to the job.
+    void Abort() {
+      if (download_)
+        download_->Abort();
+      else if (handler_)
+        handler_->Abort();
+      download_ = NULL;
+      handler_ = NULL;
+    }
+
+    virtual void OnDownloadStart(const std::string& file_name,
+        int64_t total_bytes) {
+      total_bytes_ = total_bytes;
+      // A download that starts over keeps none of the earlier bytes.
+      resumed_bytes_ = 0;
+      manager_->listener_->OnDownloadStart(file_name, total_bytes);
+    }
+
+    virtual void OnDownloadResumed(const std::string& file_name,
+        int64_t bytes) {
+      resumed_bytes_ = bytes;
+      manager_->listener_->OnDownloadResumed(file_name, bytes);
+    }
+
+    virtual void OnDownloadData(const std::string& file_name,
+        int64_t offset, const char* data, int32_t size) {
+      if (first_byte_time_ < 0)
+        first_byte_time_ = Now();
+      bytes_ += size;
+      manager_->OnJobData(this, size);
+      manager_->listener_->OnDownloadData(file_name, offset, data, size);
+    }
+
+    virtual void OnDownloadCached(const std::string& file_name) {
+      manager_->listener_->OnDownloadCached(file_name);
+    }
+
+    virtual bool IsBehind(const std::string& file_name) {
+      return manager_->listener_->IsBehind(file_name);
+    }
+
+    virtual void OnDownloadEnd(const std::string& file_name,
+        const std::string& url, bool success, std::string* body) {
+      manager_->listener_->OnDownloadEnd(file_name, url, success, body);
+      // Deletes |this|; the handler does not use its listener any more.
+      manager_->OnJobEnd(this, success);
+    }
+
+  private:
+    DownloadManager* manager_;  // Weak pointer.
+    std::string url_;
+    std::string file_name_;
+    std::string origin_;
+    Priority priority_;  // Of the queue it waits in.
+    DownloadFileWriter* writer_;
+    // What runs the download once it has started; they delete themselves
+    // after OnDownloadEnd(), as the job is.
+    SegmentedDownload* download_;
+    URLLoaderHandler* handler_;
+    double request_time_;
+    double first_byte_time_;
+    int64_t bytes_;
+    int64_t resumed_bytes_;
+    int64_t total_bytes_;
+    double report_time_;
+    int64_t report_bytes_;
+
+    Job(const Job&);
+    void operator=(const Job&);
+};
+
+DownloadManager::DownloadManager(pp::Instance* instance,
+    URLLoaderHandler::Listener* listener)
+: instance_(instance),
+  listener_(listener),
+  max_per_origin_(kDefaultMaxPerOrigin),
+  max_active_(kDefaultMaxActive),
+  active_(0),
+  completed_(0),
+  failed_(0),
+  joined_(0),
+  bytes_(0),
+  busy_seconds_(0),
+  busy_since_(0) {}
+
+DownloadManager::~DownloadManager() {
+  // Running jobs are aborted: their handlers would otherwise report to the
+  // listener, and write through the file work queue, of an instance that
+  // is gone.
+  for (std::set<Job*>::iterator it = jobs_.begin(); it != jobs_.end(); ++it) {
+    Job* job = *it;
+    if (!Unqueue(job))
+      job->Abort();
+    delete job;
+  }
+}
+
+void DownloadManager::Enqueue(const std::string& url,
+    const std::string& file_name, Priority priority,
+    DownloadFileWriter* writer) {
+  if (priority < 0 || priority >= kPriorityCount)
+    priority = kPriorityNormal;
+  Job* job = new Job(this, url, file_name, writer);
+  job->set_priority(priority);
+  jobs_.insert(job);
+  queues_[priority].push_back(job);
+  Pump();
+}
+
+bool DownloadManager::Cancel(const std::string& file_name) {
+  for (int i = 0; i < kPriorityCount; ++i) {
+    std::deque<Job*>& queue = queues_[i];
+    for (std::deque<Job*>::iterator it = queue.begin(); it != queue.end(); ++it) {
+      Job* job = *it;
+      if (job->file_name() == file_name) {
+        queue.erase(it);
+        jobs_.erase(job);
+        delete job;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+DownloadManager::Stats DownloadManager::GetStats() const {
+  Stats stats;
+  stats.queued = 0;
+  for (int i = 0; i < kPriorityCount; ++i)
+    stats.queued += queues_[i].size();
+  stats.active = active_;
+  stats.completed = completed_;
+  stats.failed = failed_;
+  stats.joined = joined_;
+  stats.bytes = bytes_;
+  double seconds = busy_seconds_;
+  if (active_ > 0)
+    seconds += Now() - busy_since_;
+  stats.bytes_per_second = seconds > 0 ? bytes_ / seconds : 0;
+  return stats;
+}
+
+// static
+std::string DownloadManager::OriginOf(const std::string& url) {
+  size_t scheme_end = url.find("://");
+  if (scheme_end == std::string::npos)
+    return std::string();
+  size_t host_end = url.find_first_of("/?#", scheme_end + 3);
+  return url.substr(0, host_end);
+}
+
+void DownloadManager::Pump() {
+  while (active_ < max_active_) {
+    Job* job = TakeNextJob();
+    if (!job)
+      return;
+    if (active_ == 0)
+      busy_since_ = Now();
+    active_++;
+    active_per_origin_[job->origin()]++;
+    if (!job->Start())
+      OnJobEnd(job, false);
+  }
+}
+
+DownloadManager::Job* DownloadManager::TakeNextJob() {
+  for (int i = 0; i < kPriorityCount; ++i) {
+    std::deque<Job*>& queue = queues_[i];
+    for (std::deque<Job*>::iterator it = queue.begin(); it != queue.end(); ++it) {
+      if (active_per_origin_[(*it)->origin()] < max_per_origin_) {
+        Job* job = *it;
+        queue.erase(it);
+        return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+bool DownloadManager::Unqueue(Job* job) {
+  std::deque<Job*>& queue = queues_[job->priority()];
+  std::deque<Job*>::iterator it = std::find(queue.begin(), queue.end(), job);
+  if (it == queue.end())
+    return false;
+  queue.erase(it);
+  return true;
+}
+
+void DownloadManager::OnJobData(Job* job, int32_t size) {
+  bytes_ += size;
+  double now = Now();
+  if (now - job->report_time() >= kProgressIntervalSeconds) {
+    PostProgress(*job, now);
+    job->set_reported(now);
+  }
+}
+
+void DownloadManager::PostProgress(const Job& job, double now) {
+  double recent = (job.bytes() - job.report_bytes()) / (now - job.report_time());
+  double since_first_byte = now - job.first_byte_time();
+  std::stringstream ss[5];
+  // Of the file, so it reaches the total bytes; the speeds are of this
+  // transfer only.
+  ss[0] << job.resumed_bytes() + job.bytes();
+  ss[1] << job.total_bytes();
+  ss[2] << static_cast<int64_t>(recent);
+  ss[3] << (since_first_byte > 0 ?
+      static_cast<int64_t>(job.bytes() / since_first_byte) : -1);
+  ss[4] << static_cast<int64_t>(
+      (job.first_byte_time() - job.request_time()) * 1000);
+  pp::VarArray message;
+  message.Set(0, "URLLOADER");
+  message.Set(1, "PROGRESS");
+  message.Set(2, job.file_name());
+  for (int i = 0; i < 5; ++i)
+    message.Set(3 + i, ss[i].str());
+  instance_->PostMessage(message);
+}
+
+void DownloadManager::PostDone(const Job& job, bool success, double now) {
+  double first_byte = job.first_byte_time() < 0 ? -1 :
+    job.first_byte_time() - job.request_time();
+  double body_seconds = job.first_byte_time() < 0 ? -1 :
+    now - job.first_byte_time();
+  double speed = body_seconds > 0 ? job.bytes() / body_seconds : -1;
+  if (success)
+    telemetry_.Record(job.origin(), first_byte, now - job.request_time(), speed);
+
+  std::stringstream ss[5];
+  ss[0] << (success ? 1 : 0);
+  ss[1] << job.bytes();
+  ss[2] << static_cast<int64_t>(first_byte < 0 ? -1 : first_byte * 1000);
+  ss[3] << static_cast<int64_t>((now - job.request_time()) * 1000);
+  ss[4] << static_cast<int64_t>(speed);
+  pp::VarArray message;
+  message.Set(0, "URLLOADER");
+  message.Set(1, "DONE");
+  message.Set(2, job.file_name());
+  for (int i = 0; i < 5; ++i)
+    message.Set(3 + i, ss[i].str());
+  instance_->PostMessage(message);
+}
+
+void DownloadManager::OnJobEnd(Job* job, bool success) {
+  PostDone(*job, success, Now());
+  if (success)
+    completed_++;
+  else
+    failed_++;
+  if (--active_per_origin_[job->origin()] == 0)
+    active_per_origin_.erase(job->origin());
+  if (--active_ == 0)
+    busy_seconds_ += Now() - busy_since_;
+  jobs_.erase(job);
+  delete job;
+  Pump();
+}
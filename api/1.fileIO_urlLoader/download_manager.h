@@ -0,0 +1,139 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DOWNLOAD_MANAGER_H_
+#define DOWNLOAD_MANAGER_H_
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/instance.h"
+
+#include "download_telemetry.h"
+#include "url_loader_handler.h"
+
+class DownloadFileWriter;
+
+// DownloadManager queues URL downloads and runs a bounded number of them at
+// once: at most max_per_origin() to the same origin and max_active() in
+// total.  Jobs wait in one queue per priority, so a visible image always
+// starts before a background prefetch, and jobs of the same priority start
+// in the order they were queued.
+//
+// While a download runs, the manager posts its progress to the page at most
+// a few times a second:
+//   ["URLLOADER", "PROGRESS", file name, bytes of the file in (including
+//    those a resumed download saved before), total bytes, bytes/s lately,
+//    bytes/s on average, ms to the first byte]
+// and once it ends:
+//   ["URLLOADER", "DONE", file name, "1" or "0", bytes received,
+//    ms to the first byte, ms in all, bytes/s on average]
+// (-1 where a value is not known).  Completed downloads are also added to
+// per-origin histograms, see telemetry().
+//
+// Every download is reported to the manager's own Listener as if it had
+// been started directly.  Downloads written to a file are fetched by a
+// SegmentedDownload, so their bytes may be reported out of order.  All
+// methods must be called on the main thread.
+//
+// Destroying the manager drops the queued downloads and aborts the running
+// ones without telling the Listener.  The FileWorkQueue of their writers
+// must have been joined by then, so no file work is left that refers to
+// them.
+//
+// EXAMPLE USAGE:
+// DownloadManager downloads(instance, listener);
+// downloads.Enqueue("http://host/1.bmp", "/1.bmp",
+//     DownloadManager::kPriorityVisible, writer);
+//
+class DownloadManager {
+  public:
+    enum Priority {
+      kPriorityVisible,   // Shown to the user as soon as it arrives.
+      kPriorityNormal,
+      kPriorityPrefetch,  // Only needed if the user goes on.
+      kPriorityCount
+    };
+
+    struct Stats {
+      uint32_t queued;      // Jobs waiting to start.
+      uint32_t active;      // Jobs downloading.
+      uint32_t completed;
+      uint32_t failed;
+      uint32_t joined;      // Requests served by a download under way,
+                            // see CountJoined().
+      int64_t bytes;        // Body bytes received by all jobs.
+      double bytes_per_second;  // Over the time any job was active.
+    };
+
+    DownloadManager(pp::Instance* instance, URLLoaderHandler::Listener* listener);
+    ~DownloadManager();
+
+    void set_max_per_origin(int count) { max_per_origin_ = count; }
+    void set_max_active(int count) { max_active_ = count; }
+    int max_per_origin() const { return max_per_origin_; }
+    int max_active() const { return max_active_; }
+
+    // Queues the download of |url| as |file_name|.  The body goes to
+    // |writer| if it is not NULL (the manager takes a reference).
+    void Enqueue(const std::string& url, const std::string& file_name,
+        Priority priority, DownloadFileWriter* writer);
+
+    // Drops the queued download of |file_name|.  Returns false if there is
+    // none, for instance because it has already started.
+    bool Cancel(const std::string& file_name);
+
+    // Counts, in the stats, a request that was not queued because it
+    // joined a download under way.  Callers keep from asking twice for the
+    // same download; the manager itself does not look for it.
+    void CountJoined() { joined_++; }
+
+    Stats GetStats() const;
+    const DownloadTelemetry& telemetry() const { return telemetry_; }
+
+    // "http://host:port" for absolute URLs, "" for ones relative to the page.
+    static std::string OriginOf(const std::string& url);
+
+  private:
+    class Job;
+    friend class Job;
+
+    // Starts queued jobs while the limits allow.
+    void Pump();
+    // Takes the first job, most urgent first, whose origin has room.
+    Job* TakeNextJob();
+    // Removes |job| from the queue it waits in; false if it is not queued.
+    bool Unqueue(Job* job);
+    void OnJobData(Job* job, int32_t size);
+    void OnJobEnd(Job* job, bool success);
+    void PostProgress(const Job& job, double now);
+    void PostDone(const Job& job, bool success, double now);
+
+    pp::Instance* instance_;                 // Weak pointer.
+    URLLoaderHandler::Listener* listener_;   // Weak pointer.
+    int max_per_origin_;
+    int max_active_;
+
+    std::deque<Job*> queues_[kPriorityCount];
+    // Queued and running jobs.
+    std::set<Job*> jobs_;
+    std::map<std::string, int> active_per_origin_;
+    int active_;
+
+    uint32_t completed_;
+    uint32_t failed_;
+    uint32_t joined_;
+    int64_t bytes_;
+    // Time spent with at least one job active, up to busy_since_.
+    double busy_seconds_;
+    double busy_since_;
+    DownloadTelemetry telemetry_;
+
+    DownloadManager(const DownloadManager&);
+    void operator=(const DownloadManager&);
+};
+
+#endif  // DOWNLOAD_MANAGER_H_
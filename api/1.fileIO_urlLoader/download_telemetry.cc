@@ -0,0 +1,91 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <sstream>
+
+#include "download_telemetry.h"
+
+namespace {
+  void DescribeHistogram(const std::string& origin, const char* name,
+      const Histogram& histogram, std::vector<std::string>* lines) {
+    if (histogram.count() == 0)
+      return;
+    // Trailing empty buckets are left out.
+    int used = Histogram::kBucketCount;
+    while (used > 0 && histogram.bucket(used - 1) == 0)
+      used--;
+    std::stringstream ss;
+    ss << (origin.empty() ? "(page)" : origin) << ' ' << name << ' '
+       << histogram.count() << ' ' << histogram.Percentile(50) << ' '
+       << histogram.Percentile(90) << ' ' << histogram.max();
+    for (int i = 0; i < used; ++i)
+      ss << ' ' << histogram.bucket(i);
+    lines->push_back(ss.str());
+  }
+}
+
+const int Histogram::kBucketCount;
+
+Histogram::Histogram() : count_(0), max_(0) {
+  std::fill(buckets_, buckets_ + kBucketCount, 0);
+}
+
+void Histogram::Add(double value) {
+  int i = 0;
+  while (i < kBucketCount - 1 && value >= BucketLimit(i))
+    i++;
+  buckets_[i]++;
+  count_++;
+  max_ = std::max(max_, value);
+}
+
+// static
+double Histogram::BucketLimit(int i) {
+  double limit = 1;
+  for (; i > 0; --i)
+    limit *= 2;
+  return limit;
+}
+
+double Histogram::Percentile(double percent) const {
+  if (count_ == 0)
+    return 0;
+  // The rank of the value wanted, counting from 1.
+  double rank = count_ * percent / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < kBucketCount; ++i) {
+    seen += buckets_[i];
+    if (seen > 0 && seen >= rank)
+      return std::min(BucketLimit(i), max_);
+  }
+  return max_;
+}
+
+DownloadTelemetry::DownloadTelemetry() {}
+
+void DownloadTelemetry::Record(const std::string& origin,
+    double first_byte_seconds, double total_seconds,
+    double bytes_per_second) {
+  OriginStats& stats = origins_[origin];
+  if (first_byte_seconds >= 0)
+    stats.first_byte_ms.Add(first_byte_seconds * 1000);
+  if (total_seconds >= 0)
+    stats.total_ms.Add(total_seconds * 1000);
+  if (bytes_per_second >= 0)
+    stats.kilobytes_per_second.Add(bytes_per_second / 1024);
+}
+
+std::vector<std::string> DownloadTelemetry::Describe() const {
+  std::vector<std::string> lines;
+  for (OriginMap::const_iterator it = origins_.begin();
+      it != origins_.end(); ++it) {
+    DescribeHistogram(it->first, "first_byte_ms", it->second.first_byte_ms,
+        &lines);
+    DescribeHistogram(it->first, "total_ms", it->second.total_ms, &lines);
+    DescribeHistogram(it->first, "kb_per_s", it->second.kilobytes_per_second,
+        &lines);
+  }
+  return lines;
+}
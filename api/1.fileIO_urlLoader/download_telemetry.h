@@ -0,0 +1,76 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DOWNLOAD_TELEMETRY_H_
+#define DOWNLOAD_TELEMETRY_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+
+// Histogram counts values in power-of-two buckets: bucket 0 holds values
+// below 1, bucket i values in [2^(i-1), 2^i).  Percentiles are reported as
+// the upper bound of the bucket they fall in, which is close enough to tell
+// a 50 ms wait from a 2 s one.
+class Histogram {
+  public:
+    static const int kBucketCount = 32;
+
+    Histogram();
+
+    void Add(double value);
+
+    uint32_t count() const { return count_; }
+    double max() const { return max_; }
+    uint32_t bucket(int i) const { return buckets_[i]; }
+    // Upper bound of bucket |i|.
+    static double BucketLimit(int i);
+    // Upper bound of the bucket holding the |percent|th percentile, or 0
+    // if nothing was added.
+    double Percentile(double percent) const;
+
+  private:
+    uint32_t buckets_[kBucketCount];
+    uint32_t count_;
+    double max_;
+};
+
+// DownloadTelemetry keeps, for every origin, histograms of how long
+// downloads waited for their first byte, how long they took in all and how
+// fast the body came, so slow loads can be told apart from slow decoding.
+//
+// EXAMPLE USAGE:
+// DownloadTelemetry telemetry;
+// telemetry.Record("http://host", 0.120, 1.5, 2e6);
+// std::vector<std::string> lines = telemetry.Describe();
+//
+class DownloadTelemetry {
+  public:
+    struct OriginStats {
+      Histogram first_byte_ms;     // From request to the first body byte.
+      Histogram total_ms;          // From request to the last byte.
+      Histogram kilobytes_per_second;  // Of the body, once it started.
+    };
+    typedef std::map<std::string, OriginStats> OriginMap;
+
+    DownloadTelemetry();
+
+    // Records a complete download from |origin|.  A negative time or speed
+    // is not known and not recorded.
+    void Record(const std::string& origin, double first_byte_seconds,
+        double total_seconds, double bytes_per_second);
+
+    const OriginMap& origins() const { return origins_; }
+
+    // One line per origin and histogram:
+    // "<origin> <histogram> <count> <p50> <p90> <max> <bucket counts...>",
+    // "(page)" standing for the page's own origin.
+    std::vector<std::string> Describe() const;
+
+  private:
+    OriginMap origins_;
+};
+
+#endif  // DOWNLOAD_TELEMETRY_H_
@@ -29,20 +29,30 @@ function attachListeners() {
   addEventListenerToButton('loadURL', loadUrl);
   addEventListenerToButton('delete', deleteFileOrDirectory);
   addEventListenerToButton('listDir', listDir);
+  addEventListenerToButton('cacheStats', cacheStats);
+  addEventListenerToButton('downloadStats', downloadStats);
 }
 
 function loadUrl() {
   if (common.naclModule) {
     var fileName = document.querySelector('#loadURL input').value;
-    common.naclModule.postMessage(['URLLOADER','getUrl:3.bmp', fileName]);
+    common.naclModule.postMessage(
+        ['URLLOADER','getUrl:3.bmp', fileName, 'visible']);
   }
 }
 
+// Id of the next FILEIO request; every reply to a request carries its id.
+var nextRequestId = 0;
+// FILEIO requests not DONE yet: the command of each, by id.
+var pendingRequests = {};
+
 function makeMessage(command, path) {
   // Package a message using a simple protocol containing:
-  // [command, <path>, <extra args>...]
-  var msg = ['FILEIO',command, path];
-  for (var i = 3; i < arguments.length; ++i) {
+  // [command, <request id>, <path>, <extra args>...]
+  var requestId = nextRequestId++;
+  pendingRequests[requestId] = command;
+  var msg = ['FILEIO', command, requestId, path];
+  for (var i = 2; i < arguments.length; ++i) {
     msg.push(arguments[i]);
   }
   return msg;
@@ -81,6 +91,16 @@ function makeDir() {
   }
 }
 
+function cacheStats() {
+  if (common.naclModule)
+    common.naclModule.postMessage(['CACHE', 'stats']);
+}
+
+function downloadStats() {
+  if (common.naclModule)
+    common.naclModule.postMessage(['URLLOADER', 'stats']);
+}
+
 /*
    function rename() {
    if (common.naclModule) {
@@ -96,6 +116,7 @@ function handleMessage(message_event) {
   var fromFile = 'FILEIO';
   var fromUrl = 'URLLOADER';
   var fromGraphics = 'GRAPHICS';
+  var fromCache = 'CACHE';
   var rawMsg = message_event.data;
   // Parse the raw message to prefix and message
   // depending on the prefix, decide whether the message is from fileIO or urlLoader
@@ -105,8 +126,20 @@ function handleMessage(message_event) {
   if (prefix == fromFile) {
     var command = msg[0];
     var args = msg.slice(1);
+    // Replies to a request have its id after the command.
+    var requestId = null;
+    if (typeof args[0] == 'number') {
+      requestId = args[0];
+      args = args.slice(1);
+    }
 
-    if (command == 'ERR') {
+    if (command == 'DONE') {
+      // [DONE, id, result]: the last reply to a request, 0 meaning success.
+      var requestCommand = pendingRequests[requestId];
+      delete pendingRequests[requestId];
+      if (args[0] != 0)
+        common.logMessage(requestCommand + ' #' + requestId + ' failed: ' + args[0]);
+    } else if (command == 'ERR') {
       common.logMessage('Error: ' + args[0]);
     } else if (command == 'STAT') {
       common.logMessage(args[0]);
@@ -146,6 +179,51 @@ function handleMessage(message_event) {
     }
   }
 
+  else if (prefix == fromUrl && msg[0] == 'STATS') {
+    // [queued, active, completed, failed, joined, bytes, bytes per second]
+    var args = msg.slice(1);
+    common.logMessage('Downloads: ' + args[0] + ' queued, ' + args[1] +
+        ' active, ' + args[2] + ' done, ' + args[3] + ' failed, ' +
+        args[4] + ' joined, ' + args[5] + ' bytes at ' + args[6] +
+        ' bytes/s');
+  }
+
+  else if (prefix == fromUrl && msg[0] == 'HISTOGRAMS') {
+    // One line per origin and histogram:
+    // origin name count p50 p90 max bucket counts...
+    var args = msg.slice(1);
+    for (var i = 0; i < args.length; ++i) {
+      var fields = args[i].split(' ');
+      common.logMessage(fields[0] + ' ' + fields[1] + ': ' + fields[2] +
+          ' downloads, median ' + fields[3] + ', 90% ' + fields[4] +
+          ', max ' + fields[5]);
+    }
+  }
+
+  else if (prefix == fromUrl && msg[0] == 'PROGRESS') {
+    // [file name, received, total, bytes/s lately, bytes/s average,
+    //  ms to first byte]
+    var args = msg.slice(1);
+    var total = args[2] >= 0 ? ' of ' + args[2] : '';
+    common.updateStatus(args[0] + ': ' + args[1] + total + ' bytes, ' +
+        args[3] + ' bytes/s');
+  }
+
+  else if (prefix == fromUrl && msg[0] == 'DONE') {
+    // [file name, ok, received, ms to first byte, ms in all, bytes/s]
+    // A request that joined a download made by another one has no numbers
+    // of its own: they are all -1.
+    var args = msg.slice(1);
+    if (args[2] < 0) {
+      common.logMessage(args[0] + (args[1] == '1' ? ' done' : ' failed') +
+          ' (joined)');
+    } else {
+      common.logMessage(args[0] + (args[1] == '1' ? ' done: ' : ' failed: ') +
+          args[2] + ' bytes, first byte after ' + args[3] + ' ms, ' +
+          args[4] + ' ms in all');
+    }
+  }
+
   else if (prefix == fromUrl) {
     // Find the first line break.  This separates the URL data from the
     // result text.  Note that the result text can contain any number of
@@ -175,4 +253,16 @@ function handleMessage(message_event) {
       common.naclModule.height = parseInt(height);
     }
   }
+
+  else if (prefix == fromCache) {
+    var command = msg[0];
+    var args = msg.slice(1);
+
+    if (command == 'STATS') {
+      // [hits, misses, evictions, entries, bytes, budget bytes]
+      common.logMessage('Image cache: ' + args[0] + ' hits, ' +
+          args[1] + ' misses, ' + args[2] + ' evictions, ' +
+          args[3] + ' images (' + args[4] + ' of ' + args[5] + ' bytes)');
+    }
+  }
 }
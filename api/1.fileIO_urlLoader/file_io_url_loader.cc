@@ -5,8 +5,10 @@
 /// @file file_io_url_loader.cc
 
 #define __STDC_LIMIT_MACROS
+#include <pthread.h>
 #include <stdio.h>
 
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -24,12 +26,28 @@
 #include "ppapi/cpp/module.h"
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_array_buffer.h"
 #include "ppapi/utility/completion_callback_factory.h"
 #include "ppapi/utility/threading/simple_thread.h"
 
 #include "ppapi/cpp/url_loader.h"
 #include "url_loader_handler.h"
 
+#include "bmp_decoder.h"
+#include "byte_range_set.h"
+#include "canvas_layout.h"
+#include "download_file_writer.h"
+#include "download_manager.h"
+#include "file_work_queue.h"
+#include "frame_scheduler.h"
+#include "image_cache.h"
+#include "overlay_layer.h"
+#include "pixel_converter.h"
+#include "series_prefetcher.h"
+#include "shape_rasterizer.h"
+#include "single_flight.h"
+#include "worker_pool.h"
+
 #include "ppapi/c/ppb_image_data.h"
 #include "ppapi/cpp/graphics_2d.h"
 #include "ppapi/cpp/image_data.h"
@@ -53,15 +71,67 @@ namespace {
   const char* const kLoadUrlMethodId = "getUrl";
   static const char kMessageArgumentSeparator = ':';
   static const int kMouseRadius = 1;
+  // Space left around and between the images on the canvas.
+  static const int32_t kImageMargin = 10;
+  // Downloads larger than this are not shown while they arrive.
+  static const size_t kMaxStreamedBytes = 64 * 1024 * 1024;
+  // Reading a shown download pauses while this many of its chunks wait for
+  // the canvas work.
+  static const int32_t kMaxQueuedStreamChunks = 4;
+  // Images wrap to a new row past this width.
+  static const int32_t kMaxCanvasWidth = 3000;
+  // The page shows each uploaded image this many times side by side.
+  static const int kUploadCopies = 3;
+  // Pixel bytes of decoded images kept by the module for all instances.
+  static const size_t kImageCacheBytes = 32 * 1024 * 1024;
+  // File operations that may run at once, so a large save does not hold up
+  // a listing.
+  static const int kFileThreads = 3;
+  // Key of the file work that draws on the canvas or follows the streamed
+  // download; it runs in order.  Paths begin with '/', so none clashes.
+  static const char kCanvasKey[] = "canvas";
+  // Stands for a request the page gave no id, and for work nobody asked for.
+  static const int32_t kNoRequestId = -1;
+  // Kinds of the operations shared through the SingleFlight; a key is the
+  // kind, '\n' and the names of what is worked on.
+  static const char kLoadFlight[] = "load";
+  static const char kDownloadFlight[] = "getUrl";
+
+  std::string FlightKey(const char* kind, const std::string& names) {
+    return std::string(kind) + '\n' + names;
+  }
 
-  uint32_t MakeColor(uint8_t r, uint8_t g, uint8_t b) {
-    uint8_t a = 255;
-    PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
-    if (format == PP_IMAGEDATAFORMAT_BGRA_PREMUL) {
-      return (a << 24) | (r << 16) | (g << 8) | b;
-    } else {
-      return (a << 24) | (b << 16) | (g << 8) | r;
+  // Two URLs may be fetched into one file, so both make the key.
+  std::string DownloadFlightKey(const std::string& url,
+      const std::string& file_name) {
+    return FlightKey(kDownloadFlight, url + '\n' + file_name);
+  }
+
+  // Largest single write.  Each FileIO::Write() takes an int32_t size and is
+  // copied to the browser in one piece; bounded writes keep that copy small
+  // and let files of any size be saved.
+  static const int32_t kMaxWriteBytes = 4 * 1024 * 1024;
+
+  // Writes |size| bytes at |data| into |file| from |offset| on, one bounded
+  // write after the other.  A write may take fewer bytes than it was given;
+  // the next one goes on from there.  Runs on a thread that may block.
+  // Returns PP_OK or the error met.
+  int32_t WriteFully(pp::FileIO* file, int64_t offset, const char* data,
+      int64_t size) {
+    int64_t written = 0;
+    while (written < size) {
+      int32_t chunk_size =
+          static_cast<int32_t>(
+              std::min<int64_t>(kMaxWriteBytes, size - written));
+      int32_t bytes_written = file->Write(offset + written, data + written,
+          chunk_size, pp::BlockUntilComplete());
+      if (bytes_written < 0)
+        return bytes_written;
+      if (bytes_written == 0)
+        return PP_ERROR_FAILED;
+      written += bytes_written;
     }
+    return PP_OK;
   }
 }
 
@@ -71,38 +141,56 @@ namespace {
 /// attributes:
 ///     type="application/x-nacl"
 ///     src="file_io_url_loader.nmf"
-class FileIoUrlLoaderInstance : public pp::Instance {
+class FileIoUrlLoaderInstance : public pp::Instance,
+  public FrameScheduler::Client,
+  public URLLoaderHandler::Listener,
+  public SeriesPrefetcher::Client,
+  public SingleFlight::Waiter {
   public:
     /// The constructor creates the plugin-side instance.
     /// @param[in] instance the handle to the browser-side plugin instance.
-    explicit FileIoUrlLoaderInstance(PP_Instance instance)
+    /// @param[in] image_cache decoded images shared with other instances.
+    /// @param[in] flights loads and downloads shared with other instances.
+    FileIoUrlLoaderInstance(PP_Instance instance, ImageCache* image_cache,
+        SingleFlight* flights)
       : pp::Instance(instance),
       callback_factory_(this),
+      image_cache_(image_cache),
+      flights_(flights),
       file_system_(this, PP_FILESYSTEMTYPE_LOCALPERSISTENT),
-      buffer_(NULL),
-      array_(NULL),
+      frame_scheduler_(this, this),
+      download_manager_(this, this),
+      prefetcher_(this),
+      data(NULL),
+      converter_(pp::ImageData::GetNativeImageDataFormat()),
       device_scale_(1.0f),
       mouse_first_down_(true),
       file_system_ready_(false),
-      file_thread_(this) {}
+      decode_pool_(this, WorkerPool::DefaultThreadCount()),
+      file_queue_(this, kFileThreads),
+      queued_stream_chunks_(0) {
+      pthread_mutex_init(&canvas_lock_, NULL);
+    }
 
     virtual ~FileIoUrlLoaderInstance() {
-      delete[] array_;
-      delete[] buffer_;
-      file_thread_.Join(); 
+      // Before the work left in the file_queue_ runs: requests of other
+      // instances that joined ours are told they were aborted.
+      flights_->RemoveWaiter(this);
+      file_queue_.Join();
+      pthread_mutex_destroy(&canvas_lock_);
     }
 
     virtual bool Init(uint32_t /*argc*/,
         const char * /*argn*/ [],
         const char * /*argv*/ []) {
       RequestInputEvents(PP_INPUTEVENT_CLASS_MOUSE);
-      file_thread_.Start();
-      // Open the file system on the file_thread_. Since this is the first
-      // operation we perform there, and because we do everything on the
-      // file_thread_ synchronously, this ensures that the FileSystem is open
-      // before any FileIO operations execute.
-      file_thread_.message_loop().PostWork(
+      decode_pool_.Start();
+      // Open the file system before anything else in the file_queue_.  The
+      // work runs alone and everything posted later waits for it, so the
+      // FileSystem is open before any FileIO operations execute.
+      file_queue_.PostExclusiveWork(
           callback_factory_.NewCallback(&FileIoUrlLoaderInstance::OpenFileSystem));
+      file_queue_.Start();
       return true;
     }
 
@@ -126,7 +214,7 @@ class FileIoUrlLoaderInstance : public pp::Instance {
     }
 
     virtual bool HandleInputEvent(const pp::InputEvent& event) {
-      if (!buffer_)
+      if (!data)
         return true;
       if (event.GetType() == PP_INPUTEVENT_TYPE_MOUSEDOWN) {
         pp::MouseInputEvent mouse_event(event);
@@ -163,9 +251,12 @@ class FileIoUrlLoaderInstance : public pp::Instance {
       pp::Var prefix = messageArray.Get(0);
 
       if (prefix.AsString() == "URLLOADER") { ///< message from URL Loader
+        // [getUrl:url, file name, priority] or [stats].
         std::string message = messageArray.Get(1).AsString();
         std::string filename = messageArray.Get(2).AsString();
-        if (message.find(kLoadUrlMethodId) == 0) {
+        if (message == "stats") {
+          PostDownloadStats();
+        } else if (message.find(kLoadUrlMethodId) == 0) {
           // The argument to getUrl is everything after the first ':'.
           size_t sep_pos = message.find_first_of(kMessageArgumentSeparator);
           if (sep_pos != std::string::npos) {
@@ -174,257 +265,722 @@ class FileIoUrlLoaderInstance : public pp::Instance {
                 message.c_str(),
                 url.c_str());
             fflush(stdout);
-            URLLoaderHandler* handler = URLLoaderHandler::Create(this, url, filename);
-            if (handler != NULL) {
-              // Starts asynchronous download. When download is finished or when an
-              // error occurs, |handler| posts the results back to the browser
-              // vis PostMessage and self-destroys.
-
-              handler->Start();
+            if (filename.length() == 0 || filename[0] != '/') {
+              ShowStatusMessage("File name must begin with /");
+              return;
+            }
+            std::string priority = messageArray.Get(3).is_string() ?
+              messageArray.Get(3).AsString() : std::string();
+            if (!prefetcher_.OnRequest(url, filename)) {
+              // Its prefetch is under way; OnDownloadEnd() shows it.
+              ShowStatusMessage("Waiting for prefetch");
+              return;
             }
+            // A download of the same URL into the same file, by this
+            // instance or another, will tell it how it went.
+            std::string flight_key = DownloadFlightKey(url, filename);
+            if (!flights_->Begin(flight_key, this, kNoRequestId)) {
+              download_manager_.CountJoined();
+              ShowStatusMessage("Joined the download of " + filename);
+              return;
+            }
+            download_flights_.insert(flight_key);
+            // The body goes to the file system through the file_queue_
+            // while it arrives, rather than being saved at the end.
+            DownloadFileWriter* writer = new DownloadFileWriter(this,
+                file_system_, &file_queue_, filename, true);
+            // Starts asynchronous download once the download_manager_ has
+            // room for it. When download is finished or when an error
+            // occurs, OnDownloadEnd() is called.
+            download_manager_.Enqueue(url, filename, ParsePriority(priority), writer);
+            writer->Release();
           }
         }
       }
+      else if (prefix.AsString() == "CACHE") { ///< decoded image cache
+        if (messageArray.Get(1).AsString() == "stats")
+          PostCacheStats();
+      }
       else if (prefix.AsString() == "FILEIO") { ///< message from file IO
         // Message should be an array with the following elements:
-        // [command, path, extra args]
-        std::string command = messageArray.Get(1).AsString();
-        std::string file_name = messageArray.Get(2).AsString();
+        // [command, <request id>, path, extra args]
+        // The request id is optional.  If given, it is a number >= 0 that
+        // every reply to the request carries after its command, the last
+        // reply being [DONE, id, result].  Requests may then complete in
+        // any order.
+        FileRequest request;
+        request.command = messageArray.Get(1).AsString();
+        uint32_t index = 2;
+        if (messageArray.Get(2).is_int() && messageArray.Get(2).AsInt() >= 0)
+          request.id = messageArray.Get(index++).AsInt();
+        request.path = messageArray.Get(index++).AsString();
+        request.data = messageArray.Get(index);
+        const std::string& file_name = request.path;
 
         if (file_name.length() == 0 || file_name[0] != '/') {
-          ShowStatusMessage("File name must begin with /");
+          ShowStatusMessage(request.id, "File name must begin with /");
+          PostDone(request.id, PP_ERROR_BADARGUMENT);
           return;
         }
 
-        printf("command: %s file_name: %s\n", command.c_str(), file_name.c_str());
+        printf("command: %s file_name: %s\n", request.command.c_str(), file_name.c_str());
 
-        if (command == "load") {
-          file_thread_.message_loop().PostWork(
-              callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Load, file_name));
-        } else if (command == "save") {
-          pp::Var file_data = messageArray.Get(3);
-          if (!file_data.is_array())
+        // Loads draw on the canvas; listings and loads go ahead of saves.
+        std::string key = file_name;
+        FileWorkQueue::Priority priority;
+        if (request.command == "load") {
+          // A load of the same directory under way, by this instance or
+          // another, ends this request too; see OnFlightDone().
+          if (!flights_->Begin(FlightKey(kLoadFlight, file_name), this, request.id)) {
+            ShowStatusMessage(request.id, "Joined a load under way");
             return;
-          pp::VarArray bytearray(file_data);
-          int l = bytearray.GetLength();
-          std::stringstream ss;
-          for (int i = 0 ; i < l ; i ++) {
-            int v = bytearray.Get(i).AsInt();
-            ss << (char) v;
           }
-          std::string& t = file_name;
-          ShowStatusMessage(t);
-          file_thread_.message_loop().PostWork(callback_factory_.NewCallback(
-                &FileIoUrlLoaderInstance::Save, t, ss.str()));
-        } 
-        else if (command == "delete") {
-          file_thread_.message_loop().PostWork(
-              callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Delete, file_name));
-        } else if (command == "makedir") {
-          const std::string& dir_name = file_name;
-          file_thread_.message_loop().PostWork(
-              callback_factory_.NewCallback(&FileIoUrlLoaderInstance::MakeDir, dir_name));
-        }  else if (command == "list") {
-          const std::string& dir_name = file_name;
-          file_thread_.message_loop().PostWork(
-              callback_factory_.NewCallback(&FileIoUrlLoaderInstance::List, dir_name));
-        } /* else if (command == "rename") {
-             const std::string new_name = messageArray.Get(3).AsString();
-             file_thread_.message_loop().PostWork(callback_factory_.NewCallback(
-             &FileIoUrlLoaderInstance::Rename, file_name, new_name));
-             }*/
-      }
-      else {
-        uint32_t len = messageArray.GetLength();
+          key = kCanvasKey;
+          priority = FileWorkQueue::kPriorityInteractive;
+        } else if (request.command == "list") {
+          priority = FileWorkQueue::kPriorityInteractive;
+        } else if (request.command == "save") {
+          ShowStatusMessage(request.id, file_name);
+          priority = FileWorkQueue::kPriorityBulk;
+        } else if (request.command == "delete" || request.command == "makedir") {
+          priority = FileWorkQueue::kPriorityNormal;
+        } else {
+          ShowErrorMessage(request.id, "Unknown command", PP_ERROR_BADARGUMENT);
+          PostDone(request.id, PP_ERROR_BADARGUMENT);
+          return;
+        }
+        file_queue_.PostWork(key, priority, callback_factory_.NewCallback(
+              &FileIoUrlLoaderInstance::RunFileRequest, request));
+      }
+      else if (prefix.AsString() == "UPLOAD") { ///< file chosen in the page
+        // Message should be an array with the following elements:
+        // [kind, name, ArrayBuffer], kind being "image" to show the file or
+        // "save" to store it as |name|.
+        std::string kind = messageArray.Get(1).AsString();
+        std::string name = messageArray.Get(2).AsString();
+        pp::Var payload = messageArray.Get(3);
+        if (!payload.is_array_buffer()) {
+          ShowErrorMessage("Upload without data", PP_ERROR_BADARGUMENT);
+          return;
+        }
+        // The buffer is handed over as is and mapped by the file_queue_
+        // work that draws it or writes the file.
+        pp::VarArrayBuffer buffer(payload);
         ShowStatusMessage("RECEIVED");
-        if (array_) {
-          delete[] array_;
-          array_ = NULL;
+        if (kind == "image") {
+          file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+              callback_factory_.NewCallback(&FileIoUrlLoaderInstance::ShowUpload, buffer));
+        } else if (kind == "save") {
+          if (name.length() == 0 || name[0] != '/') {
+            ShowStatusMessage("File name must begin with /");
+            return;
+          }
+          file_queue_.PostWork(name, FileWorkQueue::kPriorityBulk,
+              callback_factory_.NewCallback(&FileIoUrlLoaderInstance::SaveBuffer, name, buffer));
         }
-        array_ = new uint32_t[len];
-        for (uint32_t i = 0; i < len; i++) {
-          array_[i] = messageArray.Get(i).AsInt();
+      }
+    }
+
+    /// Draws |rect| of the next frame: the images with the overlay on top.
+    /// Called by the frame_scheduler_ on the main thread.
+    virtual void ComposeFrame(pp::ImageData* frame, const pp::Rect& rect) {
+      pthread_mutex_lock(&canvas_lock_);
+      pp::Rect region = rect.Intersect(pp::Rect(size_));
+      uint8_t* frame_data = static_cast<uint8_t*>(frame->data());
+      // Until the scheduler catches up with a new canvas size the frames
+      // have the old one; the next frame redraws everything anyway.
+      if (data && frame_data && frame->size() == size_ && !region.IsEmpty()) {
+        const int32_t frame_stride = frame->stride();
+        for (int32_t y = region.y(); y < region.bottom(); y++) {
+          const uint32_t* src = PixelRow(y) + region.x();
+          std::copy (src, src + region.width(),
+              reinterpret_cast<uint32_t*>(frame_data + y * frame_stride) + region.x());
         }
+        overlay_.CompositeInto (region,
+            reinterpret_cast<uint32_t*>(frame_data + region.y() * frame_stride) + region.x(),
+            frame_stride);
+      }
+      pthread_mutex_unlock(&canvas_lock_);
+    }
 
-        pp::Size new_size = pp::Size (3000, 3000);
-        CreateContext (new_size);
+    /// Downloads are shown while they arrive; the rows are decoded by the
+    /// file_queue_ like every other image.  Prefetches are not shown, nor
+    /// are downloads too large for it: their data is not even copied.
+    virtual void OnDownloadStart(const std::string& file_name, int64_t total_bytes) {
+      if (prefetcher_.IsPrefetch(file_name)) {
+        prefetcher_.OnPrefetchStart(file_name, total_bytes);
+        return;
+      }
+      if (total_bytes < 0 || static_cast<uint64_t>(total_bytes) <= kMaxStreamedBytes)
+        streamed_download_ = file_name;
+      else
+        streamed_download_.clear();
+      file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+          callback_factory_.NewCallback(
+            &FileIoUrlLoaderInstance::BeginStream, file_name, total_bytes));
+    }
 
-        std::stringstream ss;
-        StringVector sv;
-        ss << 3000;
-        sv.push_back(ss.str());
-        ss.str("");
-        ss << 3000;
-        sv.push_back(ss.str());
-        PostArrayMessage("GRAPHICS", "WH", sv);
+    virtual void OnDownloadData(const std::string& file_name, int64_t offset,
+        const char* data, int32_t size) {
+      if (file_name != streamed_download_)
+        return;
+      if (static_cast<uint64_t>(offset + size) > kMaxStreamedBytes) {
+        // Larger than it said, or than could be told; the rest is not shown.
+        streamed_download_.clear();
+        return;
+      }
+      __sync_fetch_and_add(&queued_stream_chunks_, 1);
+      int32_t result = file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+          callback_factory_.NewCallback(
+            &FileIoUrlLoaderInstance::StreamData, file_name, offset, std::string(data, size)));
+      if (result != PP_OK)
+        __sync_fetch_and_sub(&queued_stream_chunks_, 1);
+    }
 
-        PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
-        const bool kDontInitToZero = false;
-        image_data = pp::ImageData (this, format, new_size, kDontInitToZero);
-        data = static_cast<uint32_t*>(image_data.data());
-        if (!data) return;
+    /// Holds the download back while the canvas work has not caught up, so
+    /// the copies queued to it stay few.
+    virtual bool IsBehind(const std::string& file_name) {
+      return file_name == streamed_download_ &&
+        queued_stream_chunks_ >= kMaxQueuedStreamChunks;
+    }
 
-        UpdateWithArray (array_, 10, 10);
-        //context_.Flush(callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Nop));
-        UpdateWithArray (array_, 320, 10);
-        //context_.Flush(callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Nop));
-        UpdateWithArray (array_, 630, 10);
-        context_.Flush(callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Nop));
+    /// The file saved by an earlier download is still current; show it.
+    virtual void OnDownloadCached(const std::string& file_name) {
+      if (prefetcher_.IsPrefetch(file_name))
+        return;
+      cached_downloads_.insert(file_name);
+      ShowStatusMessage("Not modified");
+      file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+          callback_factory_.NewCallback(
+            &FileIoUrlLoaderInstance::ShowSavedFile, file_name));
+    }
 
+    virtual void OnDownloadEnd(const std::string& file_name, const std::string& url,
+        bool success, std::string* body) {
+      const std::string flight_key = DownloadFlightKey(url, file_name);
+      if (download_flights_.erase(flight_key))
+        flights_->End(flight_key, this, success ? PP_OK : PP_ERROR_FAILED);
+      if (prefetcher_.IsPrefetch(file_name)) {
+        // Decoded into the image_cache_ now, so that stepping to it is fast.
+        bool wanted = prefetcher_.OnPrefetchEnd(file_name, success);
+        if (success && wanted) {
+          file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+              callback_factory_.NewCallback(
+                &FileIoUrlLoaderInstance::ShowSavedFile, file_name));
+        } else if (success) {
+          file_queue_.PostWork(file_name, FileWorkQueue::kPriorityBulk,
+              callback_factory_.NewCallback(
+                &FileIoUrlLoaderInstance::WarmSavedFile, file_name));
+        } else if (wanted) {
+          ShowErrorMessage("Download failed", PP_ERROR_FAILED);
+        }
+        return;
+      }
+      const bool cached = cached_downloads_.erase(file_name) > 0;
+      const bool streamed = file_name == streamed_download_;
+      if (streamed)
+        streamed_download_.clear();
+      file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+          callback_factory_.NewCallback(
+            &FileIoUrlLoaderInstance::FinishStream, file_name,
+            success && streamed));
+      if (!success) {
+        ShowErrorMessage("Download failed", PP_ERROR_FAILED);
+        return;
+      }
+      if (!body) {
+        // Already written by the DownloadFileWriter, unless the saved file
+        // was still current and nothing was written.
+        if (!cached)
+          ShowStatusMessage("Save success");
+        return;
+      }
+      // Take the body over rather than copy it into the callback.
+      std::string* contents = new std::string;
+      contents->swap(*body);
+      file_queue_.PostWork(file_name, FileWorkQueue::kPriorityBulk,
+          callback_factory_.NewCallback(
+            &FileIoUrlLoaderInstance::SaveDownload, file_name, contents));
+    }
+
+    /// Prefetches go to the file system like getUrl downloads, after them.
+    virtual void StartPrefetch(const std::string& url, const std::string& file_name) {
+      DownloadFileWriter* writer = new DownloadFileWriter(this,
+          file_system_, &file_queue_, file_name, true);
+      download_manager_.Enqueue(url, file_name, DownloadManager::kPriorityPrefetch, writer);
+      writer->Release();
+    }
+
+    virtual bool CancelPrefetch(const std::string& file_name) {
+      return download_manager_.Cancel(file_name);
+    }
+
+    /// A request that joined a load or download of |key| gets its result.
+    /// The canvas of the instance that ran it already shows the outcome;
+    /// any other one is drawn from what it left in the image_cache_ or the
+    /// file system.  Called on any thread, see SingleFlight::Waiter.
+    virtual void OnFlightDone(const std::string& key, int32_t request_id,
+        int32_t result, bool own_run) {
+      size_t kind_end = key.find('\n');
+      const std::string kind = key.substr(0, kind_end);
+      if (kind == kLoadFlight) {
+        const std::string dir_name = key.substr(kind_end + 1);
+        if (result == PP_OK && !own_run) {
+          file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+              callback_factory_.NewCallback(
+                &FileIoUrlLoaderInstance::ShowJoinedLoad, request_id, dir_name));
+          return;
+        }
+        if (result != PP_OK)
+          ShowErrorMessage(request_id, "Load failed", result);
+        PostDone(request_id, result);
+      } else if (kind == kDownloadFlight) {
+        const std::string file_name = key.substr(key.find('\n', kind_end + 1) + 1);
+        if (result == PP_OK && !own_run) {
+          file_queue_.PostWork(kCanvasKey, FileWorkQueue::kPriorityInteractive,
+              callback_factory_.NewCallback(
+                &FileIoUrlLoaderInstance::ShowSavedFile, file_name));
+        }
+        // As DownloadManager reports a download, without the numbers of a
+        // transfer this request did not make.
+        pp::VarArray message;
+        message.Set(0, "URLLOADER");
+        message.Set(1, "DONE");
+        message.Set(2, file_name);
+        message.Set(3, result == PP_OK ? "1" : "0");
+        for (uint32_t i = 4; i < 8; ++i)
+          message.Set(i, "-1");
+        PostMessage(message);
       }
     }
 
-  
   private:
     void DrawMouse() {
-      int x1 = mouse_first_pos_.x();
-      int y1 = mouse_first_pos_.y();
-      int x2 = mouse_second_pos_.x();
-      int y2 = mouse_second_pos_.y();
-      int minx = x1 > x2 ? x2 : x1;
-      int maxx = x1 > x2 ? x1 : x2;
-      int miny = y1 > y2 ? y2 : y1;
-      int maxy = y1 > y2 ? y1 : y2;
-      int a = y1 - y2;
-      int b = x2 - x1;
-      int c = x1 * y2 - x2 * y1;
-
-      for (int y = miny; y < maxy; y++) {
-        for (int x = minx; x < maxx; x++) {
-          if (pow (a * x + b * y + c, 2) <= (pow (a, 2) + pow (b, 2)) * pow (kMouseRadius, 2)) {
-            buffer_[y * size_.width() * 3 + x * 3] = 255;
-            buffer_[y * size_.width() * 3 + x * 3 + 1] = 255;
-            buffer_[y * size_.width() * 3 + x * 3 + 2] = 0;
-          }
+      pthread_mutex_lock(&canvas_lock_);
+      ShapeRasterizer shapes(&overlay_, pp::Rect(content_size_));
+      shapes.set_color(converter_.MakeColor(255, 255, 0));
+      shapes.set_thickness(2 * kMouseRadius);
+      shapes.DrawLine(mouse_first_pos_, mouse_second_pos_);
+      pthread_mutex_unlock(&canvas_lock_);
+      frame_scheduler_.Invalidate(shapes.bounds());
+    }
+
+    // Prepares a blank canvas showing |content_size| pixels and tells the
+    // page how big it is.  The image that images are decoded into (and the
+    // frames and context of the frame_scheduler_) are only reallocated when
+    // the content does not fit the current ones; a smaller content reuses
+    // them and the page clips the rest.  Runs as canvas work of the
+    // file_queue_, like everything that draws below.
+    bool CreateCanvas(const pp::Size& content_size) {
+      if (content_size.IsEmpty())
+        return false;
+      pthread_mutex_lock(&canvas_lock_);
+      if (!data ||
+          content_size.width() > size_.width() ||
+          content_size.height() > size_.height()) {
+        data = NULL;
+        image_data = pp::ImageData();
+        const bool kDontInitToZero = false;
+        image_data = pp::ImageData (this, converter_.format(), content_size, kDontInitToZero);
+        data = static_cast<uint32_t*>(image_data.data());
+        if (!data) {
+          pthread_mutex_unlock(&canvas_lock_);
+          return false;
         }
+        size_ = content_size;
+        frame_scheduler_.SetSize(size_, device_scale_);
+      }
+
+      // Start from a white canvas without annotations.  Callers repaint the
+      // visible part in full with PaintCanvas() once their images are drawn,
+      // so margins do not keep pixels of earlier images.
+      for (int32_t y = 0; y < content_size.height(); y++)
+        std::fill_n (PixelRow(y), content_size.width(), 0xFFFFFFFFu);
+      overlay_.Clear();
+      content_size_ = content_size;
+      pthread_mutex_unlock(&canvas_lock_);
+
+      std::stringstream ss;
+      StringVector sv;
+      ss << content_size.width();
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << content_size.height();
+      sv.push_back(ss.str());
+      PostArrayMessage("GRAPHICS", "WH", sv);
+      return true;
+    }
+
+    // Copies pixels decoded earlier into the canvas at the given offset.
+    void DrawDecodedImage (const DecodedImage& image, uint32_t width_offset, uint32_t height_offset) {
+      if (width_offset >= static_cast<uint32_t>(size_.width()) ||
+          height_offset >= static_cast<uint32_t>(size_.height()))
+        return;
+      uint32_t width = std::min<uint32_t>(image.width(), size_.width() - width_offset);
+      uint32_t height = std::min<uint32_t>(image.height(), size_.height() - height_offset);
+      for (uint32_t y = 0; y < height; y++) {
+        const uint32_t* src = image.GetRow(y);
+        std::copy (src, src + width, PixelRow(height_offset + y) + width_offset);
       }
-      Paint (minx, miny, maxx - minx, maxy - miny);
-      context_.Flush(callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Nop));
     }
 
-    bool CreateContext(const pp::Size& new_size) {
-      const bool kIsAlwaysOpaque = false;
-      context_ = pp::Graphics2D(this, new_size, kIsAlwaysOpaque);
-      // Call SetScale before BindGraphics so the image is scaled correctly on
-      // HiDPI displays.
-      context_.SetScale(1.0f / device_scale_);
-      if (!BindGraphics(context_)) {
-        fprintf(stderr, "Unable to bind 2d context!\n");
-        context_ = pp::Graphics2D();
-        return false;
+    void PaintCanvas() {
+      frame_scheduler_.Invalidate(pp::Rect(content_size_));
+    }
+
+    // Returns row |y| of the decoded images.
+    uint32_t* PixelRow(int32_t y) {
+      return reinterpret_cast<uint32_t*>(
+          reinterpret_cast<uint8_t*>(data) + y * image_data.stride());
+    }
+
+    // Decodes |bmp| into the canvas at the given offset.  Does not paint, so
+    // several images can be drawn (from several threads, if their areas do
+    // not overlap) and painted together.
+    void DrawImage (const BmpDecoder& bmp, uint32_t width_offset, uint32_t height_offset) {
+      DrawImageRows (bmp, width_offset, height_offset, 0, bmp.height());
+    }
+
+    // Decodes rows [first_row, end_row) of |bmp|, counted from the top.
+    void DrawImageRows (const BmpDecoder& bmp, uint32_t width_offset, uint32_t height_offset,
+        int32_t first_row, int32_t end_row) {
+      if (width_offset >= static_cast<uint32_t>(size_.width()) ||
+          height_offset >= static_cast<uint32_t>(size_.height()))
+        return;
+      // Clip the image to the canvas.
+      uint32_t width = std::min<uint32_t>(bmp.width(), size_.width() - width_offset);
+      uint32_t height = std::min<uint32_t>(end_row, size_.height() - height_offset);
+
+      // Rows go straight from the file bytes into the image in native format.
+      for (uint32_t y = first_row; y < height; y++) {
+        converter_.ConvertRow (bmp.GetRow(y), PixelConverter::kSourceBGR,
+            PixelRow(height_offset + y) + width_offset, width);
       }
+    }
 
-      // Allocate a buffer of palette entries of the same size as the new context.
-      if (buffer_) {
-        delete[] buffer_;
-        buffer_ = NULL;
+    // Shows an image posted from the page, decoding it straight from the
+    // mapped buffer.
+    void ShowUpload(int32_t, const pp::VarArrayBuffer& const_buffer) {
+      pp::VarArrayBuffer buffer(const_buffer);
+      const char* bytes = static_cast<const char*>(buffer.Map());
+      BmpDecoder bmp;
+      if (!bytes || !bmp.Parse(bytes, buffer.ByteLength())) {
+        buffer.Unmap();
+        ShowErrorMessage("Not a supported BMP image", PP_ERROR_BADARGUMENT);
+        return;
       }
-      buffer_ = new uint8_t[new_size.width() * new_size.height() * 3]; // 3 for RGB
-      std::fill_n (buffer_, new_size.width() * new_size.height() * 3, 255);
-      size_ = new_size;
 
-      return true;
+      CanvasLayout layout(kImageMargin, kMaxCanvasWidth);
+      for (int i = 0; i < kUploadCopies; i++)
+        layout.Add(pp::Size(bmp.width(), bmp.height()));
+      // The new images replace any download being shown.
+      EndStream(PP_OK, stream_.file_name);
+      if (CreateCanvas (layout.canvas_size())) {
+        for (size_t i = 0; i < layout.slot_count(); i++)
+          DrawImage (bmp, layout.slot(i).x(), layout.slot(i).y());
+        PaintCanvas();
+      }
+      buffer.Unmap();
     }
 
-    uint32_t GetArrayValue (uint32_t *array, uint32_t offset, uint32_t size) {
-      uint32_t ret = 0;
-      for (int i = size - 1; i >= 0; i--) {
-        ret = ret << 8;
-        ret += array[offset + i];
+    // Shows the image saved as |file_name| as if it had just been downloaded.
+    void ShowSavedFile(int32_t, const std::string& file_name) {
+      DecodedImage* image = DecodeSavedFile(file_name);
+      if (!image)
+        return;
+      CanvasLayout layout(kImageMargin, kMaxCanvasWidth);
+      layout.Add(pp::Size(image->width(), image->height()));
+      EndStream(PP_OK, stream_.file_name);
+      if (CreateCanvas (layout.canvas_size())) {
+        DrawDecodedImage (*image, layout.slot(0).x(), layout.slot(0).y());
+        PaintCanvas();
       }
-      return ret;
+      image->Release();
     }
 
-    void UpdateWithArray (uint32_t *array, uint32_t width_offset, uint32_t height_offset) {
-      uint32_t start_offset = GetArrayValue (array, 10, 4);
-      uint32_t width = GetArrayValue (array, 18, 4);
-      uint32_t height = GetArrayValue (array, 22, 4);
-      
-      for (int y = 0; y < height; y++) {
-        uint32_t offset = (height_offset + height - 1 - y) * size_.width() * 3; // Bottom up
-        for (int x = 0; x < width; x++) {
-          buffer_[offset + (width_offset + x) * 3 + 2] = GetArrayValue (array, start_offset + y * width * 3 + x * 3, 1);
-          buffer_[offset + (width_offset + x) * 3 + 1] = GetArrayValue (array, start_offset + y * width * 3 + x * 3 + 1, 1);
-          buffer_[offset + (width_offset + x) * 3] = GetArrayValue (array, start_offset + y * width * 3 + x * 3 + 2, 1);
-        }
+    // Decodes a prefetched image into the image_cache_ without showing it.
+    // Runs on a file_queue_ thread.
+    void WarmSavedFile(int32_t, const std::string& file_name) {
+      DecodedImage* image = DecodeSavedFile(file_name);
+      if (image)
+        image->Release();
+    }
+
+    // Returns the image saved as |file_name|, from the image_cache_ if it is
+    // there or else read, decoded and cached.  The caller owns a reference;
+    // NULL on error.  Runs on a file_queue_ thread.
+    DecodedImage* DecodeSavedFile(const std::string& file_name) {
+      if (!file_system_ready_) {
+        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
+        return NULL;
+      }
+      pp::FileRef ref(file_system_, file_name.c_str());
+      PP_FileInfo info;
+      int32_t query_result =
+        ref.Query(pp::CompletionCallbackWithOutput<PP_FileInfo>(&info));
+      if (query_result != PP_OK) {
+        ShowErrorMessage("File query failed", query_result);
+        return NULL;
       }
+      DecodedImage* image = image_cache_->Lookup(
+          ref.GetPath().AsString(), info.last_modified_time);
+      if (image)
+        return image;
+
+      std::vector<char> filedata;
+      if (!ReadWholeFile(kNoRequestId, ref, &filedata))
+        return NULL;
+      BmpDecoder bmp;
+      if (!bmp.Parse(&filedata[0], filedata.size())) {
+        ShowErrorMessage("Not a supported BMP image", PP_ERROR_BADARGUMENT);
+        return NULL;
+      }
+      image = new DecodedImage(bmp.width(), bmp.height());
+      for (int32_t y = 0; y < bmp.height(); y++) {
+        converter_.ConvertRow (bmp.GetRow(y), PixelConverter::kSourceBGR,
+            image->GetRow(y), bmp.width());
+      }
+      image_cache_->Insert(ref.GetPath().AsString(), info.last_modified_time, image);
+      return image;
+    }
 
-      Paint (width_offset, height_offset, width, height);
+    // Stores a file uploaded from the page.  Runs on a file_queue_ thread.
+    void SaveBuffer(int32_t, const std::string& file_name, const pp::VarArrayBuffer& buffer) {
+      WriteBuffer(kNoRequestId, file_name, buffer);
     }
 
-    void Paint(uint32_t width_offset, uint32_t height_offset, uint32_t width, uint32_t height) {
-      // See the comment above the call to ReplaceContents below.
-      
-      for (uint32_t y = height_offset; y < height + height_offset; y++) {
-        for (uint32_t x = width_offset; x < width + width_offset; x++) {
-          uint32_t offset = y * size_.width() + x;
-          data[offset] = MakeColor (buffer_[offset * 3], buffer_[offset * 3 + 1], buffer_[offset * 3 + 2]);
+    // Stores a file posted from the page (an upload or a "save" command).
+    int32_t WriteBuffer(int32_t request_id, const std::string& file_name,
+        const pp::VarArrayBuffer& const_buffer) {
+      pp::VarArrayBuffer buffer(const_buffer);
+      const char* bytes = static_cast<const char*>(buffer.Map());
+      if (!bytes && buffer.ByteLength() > 0) {
+        ShowErrorMessage(request_id, "Upload without data", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
+      }
+      int32_t result = WriteFile(request_id, file_name, bytes, buffer.ByteLength());
+      buffer.Unmap();
+      return result;
+    }
+
+    // Starts showing the download of |file_name|, replacing any image that
+    // is being streamed.  Canvas work, as are the three below.
+    void BeginStream(int32_t, const std::string& file_name, int64_t total_bytes) {
+      stream_.file_name = file_name;
+      stream_.bytes.clear();
+      stream_.received.Clear();
+      if (total_bytes > 0 && static_cast<uint64_t>(total_bytes) <= kMaxStreamedBytes)
+        stream_.bytes.resize(total_bytes);
+      stream_.active = true;
+      stream_.canvas_ready = false;
+    }
+
+    // Decodes the rows completed by |data|, found at |offset| in the file,
+    // and paints them.  The segments of a download arrive in any order.
+    void StreamData(int32_t, const std::string& file_name, int64_t offset, const std::string& data) {
+      // Counted as handled now; |data| goes with the callback right after.
+      __sync_fetch_and_sub(&queued_stream_chunks_, 1);
+      if (!stream_.active || file_name != stream_.file_name)
+        return;
+      int64_t end = offset + data.size();
+      if (static_cast<uint64_t>(end) > kMaxStreamedBytes) {
+        // Too big to show; the download itself goes on.
+        EndStream(PP_OK, file_name);
+        return;
+      }
+      if (stream_.bytes.size() < static_cast<uint64_t>(end))
+        stream_.bytes.resize(end);
+      std::copy (data.begin(), data.end(), stream_.bytes.begin() + offset);
+      stream_.received.Add(offset, end);
+
+      if (!stream_.canvas_ready) {
+        int32_t width = 0;
+        int32_t height = 0;
+        if (!stream_.received.Contains(0, BmpDecoder::kHeaderSize))
+          return;
+        if (!BmpDecoder::ReadSize(&stream_.bytes[0], stream_.bytes.size(), &width, &height)) {
+          // Not an image this viewer can show.
+          EndStream(PP_OK, file_name);
+          return;
+        }
+        CanvasLayout layout(kImageMargin, kMaxCanvasWidth);
+        layout.Add(pp::Size(width, height));
+        if (!CreateCanvas (layout.canvas_size())) {
+          EndStream(PP_OK, file_name);
+          return;
         }
+        stream_.origin = layout.slot(0).point();
+        stream_.canvas_ready = true;
+        PaintCanvas();
+        // Rows that came in before the header are drawn now too.
+        offset = 0;
+        end = stream_.bytes.size();
       }
 
-      // Using Graphics2D::ReplaceContents is the fastest way to update the
-      // entire canvas every frame. According to the documentation:
-      //
-      //   Normally, calling PaintImageData() requires that the browser copy
-      //   the pixels out of the image and into the graphics context's backing
-      //   store. This function replaces the graphics context's backing store
-      //   with the given image, avoiding the copy.
-      //
-      //   In the case of an animation, you will want to allocate a new image for
-      //   the next frame. It is best if you wait until the flush callback has
-      //   executed before allocating this bitmap. This gives the browser the
-      //   option of caching the previous backing store and handing it back to
-      //   you (assuming the sizes match). In the optimal case, this means no
-      //   bitmaps are allocated during the animation, and the backing store and
-      //   "front buffer" (which the module is painting into) are just being
-      //   swapped back and forth.
-      //
-      
-      const pp::ImageData const_data = static_cast<const pp::ImageData>(image_data);
-      const pp::Point top_left_ (0, 0);
-      const pp::Rect src_rect_ (width_offset, height_offset, width, height);
-      //const pp::Point top_left_ (0, 0);
-      //const pp::Rect src_rect_ (0, 0, size_.width(), size_.height());
-      context_.PaintImageData (const_data, top_left_, src_rect_); 
-      //context_.ReplaceContents(&image_data);
+      // The vector may have moved; parse again to point into it.
+      BmpDecoder bmp;
+      if (!bmp.ParsePartial(&stream_.bytes[0], stream_.bytes.size()) ||
+          bmp.stored_rows() == 0)
+        return;
+      // Draw the stored rows that the new bytes touch and have completed.
+      // Rows are in file order, which is bottom-up for most bitmaps.
+      const int64_t row_bytes = static_cast<int64_t>(bmp.width()) * BmpDecoder::kBytesPerPixel;
+      const int64_t first_row_offset = bmp.StoredRowOffset(0);
+      const int64_t stride = bmp.StoredRowOffset(1) - first_row_offset;
+      int32_t top = bmp.height();
+      int32_t bottom = 0;
+      for (int32_t row = std::max<int64_t>(0, (offset - first_row_offset) / stride);
+          row < bmp.stored_rows(); row++) {
+        const int64_t row_offset = bmp.StoredRowOffset(row);
+        if (row_offset >= end)
+          break;
+        if (!stream_.received.Contains(row_offset, row_offset + row_bytes))
+          continue;
+        int32_t y = bmp.top_down() ? row : bmp.height() - 1 - row;
+        DrawImageRows (bmp, stream_.origin.x(), stream_.origin.y(), y, y + 1);
+        top = std::min(top, y);
+        bottom = std::max(bottom, y + 1);
+      }
+      if (top < bottom) {
+        frame_scheduler_.Invalidate(pp::Rect(stream_.origin.x(), stream_.origin.y() + top,
+              bmp.width(), bottom - top));
+      }
+    }
+
+    // Ends the stream of |file_name|.  If the download was |saved| but not
+    // all of it came through the stream, as when it resumed what an earlier
+    // attempt left, the image is shown from the file instead.
+    void FinishStream(int32_t, const std::string& file_name, bool saved) {
+      if (file_name != stream_.file_name)
+        return;
+      const bool shown = stream_.active && stream_.canvas_ready &&
+        stream_.received.Contains(0, stream_.bytes.size());
+      const bool show_file = saved && stream_.active && !shown;
+      EndStream(PP_OK, file_name);
+      if (show_file)
+        ShowSavedFile(PP_OK, file_name);
     }
 
-    void Nop (int32_t) {}
+    void EndStream(int32_t, const std::string& file_name) {
+      if (file_name != stream_.file_name)
+        return;
+      stream_.active = false;
+      std::vector<char>().swap(stream_.bytes);
+      stream_.received.Clear();
+    }
 
     pp::CompletionCallbackFactory<FileIoUrlLoaderInstance> callback_factory_;
+    ImageCache* image_cache_;  // Owned by the module.
+    SingleFlight* flights_;    // Owned by the module.
     pp::FileSystem file_system_;
-    pp::Graphics2D context_;
+    FrameScheduler frame_scheduler_;
+    // Runs the getUrl downloads; main thread only.  Declared before the
+    // file_queue_, so it is destroyed after the destructor has joined it.
+    DownloadManager download_manager_;
+    // SingleFlight keys of the downloads started for the page; main thread
+    // only.
+    std::set<std::string> download_flights_;
+    // Downloads found not modified, until they end; main thread only.
+    std::set<std::string> cached_downloads_;
+    // Fetches the next images of a series the user steps through.
+    SeriesPrefetcher prefetcher_;
+
+    // The canvas: the decoded images and the overlay.  Only canvas work of
+    // the file_queue_ replaces it; canvas_lock_ guards that and the overlay_ against the
+    // main thread composing frames.  Decode workers write pixels of their
+    // own slots without the lock.
+    pthread_mutex_t canvas_lock_;
     pp::Size size_;
+    // Part of the canvas showing images; may be smaller than size_.
+    pp::Size content_size_;
     pp::ImageData image_data;
     uint32_t* data;
-    uint8_t* buffer_;
-    uint32_t* array_;
+    PixelConverter converter_;
+    // Annotations drawn over the images.
+    OverlayLayer overlay_;
     float device_scale_;
     bool mouse_first_down_;
     pp::Point mouse_;
     pp::Point mouse_first_pos_;
     pp::Point mouse_second_pos_;
 
-    // Indicates whether file_system_ was opened successfully. We only read/write
-    // this on the file_thread_.
+    // Indicates whether file_system_ was opened successfully. Written once, by
+    // the first work of the file_queue_, before any other work runs.
     bool file_system_ready_;
 
-    // We do all our file operations on the file_thread_.
-    pp::SimpleThread file_thread_;
-
-    void PostArrayMessage(const std::string& prefix, const char* command, const StringVector& strings) {
+    // We do all our file operations in the file_queue_, except reading and
+    // decoding the images of a directory, which the decode_pool_ does in
+    // parallel.  Work that draws runs in order under kCanvasKey; the rest
+    // is ordered by path.
+    WorkerPool decode_pool_;
+    FileWorkQueue file_queue_;
+
+    // The download being shown while it arrives.  Only used by canvas work.
+    struct StreamedImage {
+      StreamedImage() : active(false), canvas_ready(false) {}
+      std::string file_name;
+      std::vector<char> bytes;   // The file, as far as it is known.
+      ByteRangeSet received;     // Parts of |bytes| that have arrived.
+      bool active;               // False once the rest is to be ignored.
+      bool canvas_ready;         // The header is in and the canvas sized.
+      pp::Point origin;          // Where the image is on the canvas.
+    };
+    StreamedImage stream_;
+    // The download whose data is copied to the canvas work for stream_, or
+    // "" if none is; main thread only.
+    std::string streamed_download_;
+    // Its chunks posted to the file_queue_ and not handled yet.
+    volatile int32_t queued_stream_chunks_;
+
+    // A directory load in progress.  The file thread fills in one job per
+    // image and waits; each callback posted to the decode_pool_ takes the
+    // next job, decodes the image into its slot and counts it as done.
+    struct DecodeBatch {
+      int32_t request_id;  // Of the "load" the images are for.
+      std::vector<pp::FileRef> refs;
+      std::vector<double> modified_times;
+      // Images found in the image_cache_, with a reference owned by the
+      // batch; NULL where the file has to be read.
+      std::vector<DecodedImage*> cached;
+      std::vector<pp::Rect> slots;
+      size_t next_job;
+      size_t jobs_left;
+      pthread_mutex_t lock;
+      pthread_cond_t all_done;
+    };
+
+    // A FILEIO request of the page, run by RunFileRequest().
+    struct FileRequest {
+      FileRequest() : id(kNoRequestId) {}
+      int32_t id;            // Chosen by the page, or kNoRequestId.
+      std::string command;
+      std::string path;
+      pp::Var data;          // The contents to save: a string or an ArrayBuffer.
+    };
+
+    // Posts [prefix, command, <request id>, strings...], leaving the id out
+    // of replies to requests that carry none.
+    void PostArrayMessage(const std::string& prefix, const char* command,
+        int32_t request_id, const StringVector& strings) {
       pp::VarArray message;
       // FILEIO prefix attached to the first index of VarArray
       // to differentiate message for fileIO and for urlLoader.
       message.Set(0, prefix);
       message.Set(1, command);
+      uint32_t index = 2;
+      if (request_id != kNoRequestId)
+        message.Set(index++, request_id);
       for (size_t i = 0; i < strings.size(); ++i) {
-        message.Set(i + 2, strings[i]);
+        message.Set(index++, strings[i]);
       }
 
       PostMessage(message);
     }
 
+    void PostArrayMessage(const std::string& prefix, const char* command, const StringVector& strings) {
+      PostArrayMessage(prefix, command, kNoRequestId, strings);
+    }
+
     void PostArrayMessage(const std::string& prefix, const char* command) {
       PostArrayMessage(prefix, command, StringVector());
     }
@@ -446,12 +1002,44 @@ class FileIoUrlLoaderInstance : public pp::Instance {
       }
     }
 
-    void Save(int32_t /* result */,
-        const std::string& file_name,
-        const std::string& file_contents) {
+    // Runs |request| on a file_queue_ thread and reports how it ended.
+    void RunFileRequest(int32_t, const FileRequest& request) {
+      int32_t result = PP_ERROR_BADARGUMENT;
+      if (request.command == "load") {
+        result = Load(request.id, request.path);
+      } else if (request.command == "save") {
+        // The contents are an ArrayBuffer, mapped and written as is, or a
+        // string for text files.
+        if (request.data.is_array_buffer()) {
+          result = WriteBuffer(request.id, request.path, pp::VarArrayBuffer(request.data));
+        } else if (request.data.is_string()) {
+          std::string file_contents = request.data.AsString();
+          result = WriteFile(request.id, request.path, file_contents.data(), file_contents.length());
+        }
+      } else if (request.command == "delete") {
+        result = Delete(request.id, request.path);
+      } else if (request.command == "makedir") {
+        const std::string& dir_name = request.path;
+        result = MakeDir(request.id, dir_name);
+      } else if (request.command == "list") {
+        const std::string& dir_name = request.path;
+        result = List(request.id, dir_name);
+      }
+      PostDone(request.id, result);
+    }
+
+    // Stores a finished download; takes ownership of |contents|.
+    void SaveDownload(int32_t, const std::string& file_name, std::string* contents) {
+      WriteFile(kNoRequestId, file_name, contents->data(), contents->length());
+      delete contents;
+    }
+
+    // Replaces the contents of |file_name| with |size| bytes at |data|.
+    // Returns PP_OK or the error met.
+    int32_t WriteFile(int32_t request_id, const std::string& file_name, const char* data, size_t size) {
       if (!file_system_ready_) {
-        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-        return;
+        ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
       }
       pp::FileRef ref(file_system_, file_name.c_str());
       pp::FileIO file(this);
@@ -462,198 +1050,381 @@ class FileIoUrlLoaderInstance : public pp::Instance {
             PP_FILEOPENFLAG_TRUNCATE,
             pp::BlockUntilComplete());
       if (open_result != PP_OK) {
-        ShowErrorMessage("File open for write failed", open_result);
-        return;
+        ShowErrorMessage(request_id, "File open for write failed", open_result);
+        return open_result;
       }
 
       // We have truncated the file to 0 bytes. So we need only write if
-      // file_contents is non-empty.
-      if (!file_contents.empty()) {
-        if (file_contents.length() > INT32_MAX) {
-          ShowErrorMessage("File too big", PP_ERROR_FILETOOBIG);
-          return;
+      // there is data.
+      if (size > 0) {
+        int32_t write_result = WriteFully(&file, 0, data, size);
+        if (write_result != PP_OK) {
+          ShowErrorMessage(request_id, "File write failed", write_result);
+          return write_result;
         }
-        int64_t offset = 0;
-        int32_t bytes_written = 0;
-        do {
-          bytes_written = file.Write(offset,
-              file_contents.data() + offset,
-              file_contents.length(),
-              pp::BlockUntilComplete());
-          if (bytes_written > 0) {
-            offset += bytes_written;
-          } else {
-            ShowErrorMessage("File write failed", bytes_written);
-            return;
-          }
-        } while (bytes_written < static_cast<int64_t>(file_contents.length()));
       }
 
       // All bytes have been written, flush the write buffer to complete
       int32_t flush_result = file.Flush(pp::BlockUntilComplete());
       if (flush_result != PP_OK) {
-        ShowErrorMessage("File fail to flush", flush_result);
-        return;
+        ShowErrorMessage(request_id, "File fail to flush", flush_result);
+        return flush_result;
       }
-      ShowStatusMessage("Save success");
+      ShowStatusMessage(request_id, "Save success");
+      return PP_OK;
     }
 
-    void Load(int32_t /* result */, const std::string& file_name) {
+    // Shows the directory |file_name| and ends the requests that joined
+    // the load.
+    int32_t Load(int32_t request_id, const std::string& file_name) {
+      int32_t result = LoadDirectory(request_id, file_name);
+      flights_->End(FlightKey(kLoadFlight, file_name), this, result);
+      return result;
+    }
+
+    // Shows a directory another instance has just loaded, from the images
+    // it left in the image_cache_.  Canvas work.
+    void ShowJoinedLoad(int32_t, int32_t request_id, const std::string& dir_name) {
+      PostDone(request_id, LoadDirectory(request_id, dir_name));
+    }
+
+    int32_t LoadDirectory(int32_t request_id, const std::string& file_name) {
       if (!file_system_ready_) {
-        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-        return;
+        ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
       }
       pp::FileRef ref(file_system_, file_name.c_str());
 
-      ref.ReadDirectoryEntries(callback_factory_.NewCallbackWithOutput(
-            &FileIoUrlLoaderInstance::LoadCallback, ref));
+      // Read in place: the canvas is only ours until this work returns.
+      pp::CompletionCallbackWithOutput<std::vector<pp::DirectoryEntry> >::OutputStorageType entries;
+      int32_t result = ref.ReadDirectoryEntries(
+          pp::CompletionCallbackWithOutput<std::vector<pp::DirectoryEntry> >(&entries));
+      return LoadCallback(request_id, result, entries.output());
     }
 
-    void Delete(int32_t, const std::string& file_name) {
+    int32_t Delete(int32_t request_id, const std::string& file_name) {
       if (!file_system_ready_) {
-        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-        return;
+        ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
       }
       pp::FileRef ref(file_system_, file_name.c_str());
 
       int32_t result = ref.Delete(pp::BlockUntilComplete());
       if (result == PP_ERROR_FILENOTFOUND) {
-        ShowStatusMessage("File/Directory not found");
-        return;
+        ShowStatusMessage(request_id, "File/Directory not found");
+        return result;
       } else if (result != PP_OK) {
-        ShowErrorMessage("Deletion failed", result);
-        return;
+        ShowErrorMessage(request_id, "Deletion failed", result);
+        return result;
       }
-      ShowStatusMessage("Delete success");
+      ShowStatusMessage(request_id, "Delete success");
+      return PP_OK;
     }
 
-    void List(int32_t, const std::string& dir_name) {
+    int32_t List(int32_t request_id, const std::string& dir_name) {
       if (!file_system_ready_) {
-        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-        return;
+        ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
       }
 
       pp::FileRef ref(file_system_, dir_name.c_str());
 
-      // Pass ref along to keep it alive.
-      ref.ReadDirectoryEntries(callback_factory_.NewCallbackWithOutput(
-            &FileIoUrlLoaderInstance::ListCallback, ref));
+      // Read in place, so later work on the directory waits for the listing.
+      pp::CompletionCallbackWithOutput<std::vector<pp::DirectoryEntry> >::OutputStorageType entries;
+      int32_t result = ref.ReadDirectoryEntries(
+          pp::CompletionCallbackWithOutput<std::vector<pp::DirectoryEntry> >(&entries));
+      return ListCallback(request_id, result, entries.output());
     }
 
-    void LoadCallback(int32_t result, const std::vector<pp::DirectoryEntry>& entries, pp::FileRef) {
+    // Shows the images among |entries|.  Images that cannot be read are
+    // reported and left out; only failing to read the directory or to make
+    // the canvas fails the request.
+    int32_t LoadCallback(int32_t request_id, int32_t result,
+        const std::vector<pp::DirectoryEntry>& entries) {
       if (result != PP_OK) {
-        ShowErrorMessage("Load failed", result);
+        ShowErrorMessage(request_id, "Load failed", result);
+        return result;
+      }
+
+      // Measure every image from its header first, so the canvas can be
+      // allocated at the size the images need.
+      // Images found in the image_cache_ are measured without opening them.
+      CanvasLayout layout(kImageMargin, kMaxCanvasWidth);
+      DecodeBatch batch;
+      batch.request_id = request_id;
+      for (size_t i = 0 ; i < entries.size() ; i ++) {
+        pp::FileRef ref = entries[i].file_ref();
+        PP_FileInfo info;
+        int32_t query_result =
+          ref.Query(pp::CompletionCallbackWithOutput<PP_FileInfo>(&info));
+        if (query_result != PP_OK) {
+          ShowErrorMessage(request_id, "File query failed", query_result);
+          continue;
+        }
+        if (info.type != PP_FILETYPE_REGULAR)
+          continue;
+
+        pp::Size image_size;
+        DecodedImage* cached = image_cache_->Lookup(
+            ref.GetPath().AsString(), info.last_modified_time);
+        if (cached)
+          image_size = pp::Size(cached->width(), cached->height());
+        else if (!MeasureImage(request_id, ref, &image_size))
+          continue;
+        batch.refs.push_back(ref);
+        batch.modified_times.push_back(info.last_modified_time);
+        batch.cached.push_back(cached);
+        layout.Add(image_size);
+      }
+      if (batch.refs.empty()) {
+        ShowStatusMessage(request_id, "No images to show");
+        return PP_OK;
+      }
+
+      EndStream(PP_OK, stream_.file_name);
+      if (!CreateCanvas (layout.canvas_size())) {
+        for (size_t i = 0 ; i < batch.cached.size() ; i ++) {
+          if (batch.cached[i])
+            batch.cached[i]->Release();
+        }
+        ShowErrorMessage(request_id, "Canvas allocation failed", PP_ERROR_NOMEMORY);
+        return PP_ERROR_NOMEMORY;
+      }
+
+      for (size_t i = 0 ; i < layout.slot_count() ; i ++)
+        batch.slots.push_back(layout.slot(i));
+      batch.next_job = 0;
+      batch.jobs_left = batch.refs.size();
+      pthread_mutex_init(&batch.lock, NULL);
+      pthread_cond_init(&batch.all_done, NULL);
+
+      for (size_t i = 0 ; i < batch.refs.size() ; i ++) {
+        decode_pool_.PostWork(callback_factory_.NewCallback(
+              &FileIoUrlLoaderInstance::DecodeNextImage, &batch));
+      }
+
+      pthread_mutex_lock(&batch.lock);
+      while (batch.jobs_left > 0)
+        pthread_cond_wait(&batch.all_done, &batch.lock);
+      pthread_mutex_unlock(&batch.lock);
+      pthread_cond_destroy(&batch.all_done);
+      pthread_mutex_destroy(&batch.lock);
+
+      // Every image is in place; show them all in one frame.
+      PaintCanvas();
+      PostCacheStats();
+      return PP_OK;
+    }
+
+    // Runs on a decode_pool_ thread.
+    void DecodeNextImage(int32_t, DecodeBatch* batch) {
+      pthread_mutex_lock(&batch->lock);
+      size_t job = batch->next_job++;
+      pthread_mutex_unlock(&batch->lock);
+
+      if (job < batch->refs.size()) {
+        const pp::Rect& slot = batch->slots[job];
+        DecodedImage* cached = batch->cached[job];
+        if (cached) {
+          ShowStatusMessage(batch->request_id, batch->refs[job].GetName().AsString());
+          ShowStatusMessage(batch->request_id, "Load success (cached)");
+          DrawDecodedImage (*cached, slot.x(), slot.y());
+          cached->Release();
+        } else {
+          LoadAndDrawImage (batch->request_id, batch->refs[job], batch->modified_times[job], slot);
+        }
+      }
+
+      // |batch| must not be touched once the last job is counted: the file
+      // thread is free to return as soon as it sees jobs_left reach zero.
+      pthread_mutex_lock(&batch->lock);
+      if (--batch->jobs_left == 0)
+        pthread_cond_signal(&batch->all_done);
+      pthread_mutex_unlock(&batch->lock);
+    }
+
+    // Reads and decodes the image in |ref| into |slot|, and keeps the decoded
+    // pixels in the image_cache_ if they fit.
+    void LoadAndDrawImage(int32_t request_id, const pp::FileRef& ref,
+        double modified_time, const pp::Rect& slot) {
+      std::vector<char> filedata;
+      if (!ReadWholeFile(request_id, ref, &filedata))
+        return;
+      BmpDecoder bmp;
+      if (!bmp.Parse(&filedata[0], filedata.size())) {
+        ShowErrorMessage(request_id, "Not a supported BMP image", PP_ERROR_BADARGUMENT);
         return;
       }
+      // Done reading, send content to the user interface
+      ShowStatusMessage(request_id, ref.GetName().AsString());
+      ShowStatusMessage(request_id, "Load success");
 
-      pp::Size new_size = pp::Size (3000, 3000);
-      CreateContext (new_size);
+      size_t byte_size = static_cast<size_t>(bmp.width()) * bmp.height() * sizeof(uint32_t);
+      if (!image_cache_->Fits(byte_size)) {
+        DrawImage (bmp, slot.x(), slot.y());
+        return;
+      }
+      DecodedImage* image = new DecodedImage(bmp.width(), bmp.height());
+      for (int32_t y = 0; y < bmp.height(); y++) {
+        converter_.ConvertRow (bmp.GetRow(y), PixelConverter::kSourceBGR,
+            image->GetRow(y), bmp.width());
+      }
+      image_cache_->Insert(ref.GetPath().AsString(), modified_time, image);
+      DrawDecodedImage (*image, slot.x(), slot.y());
+      image->Release();
+    }
 
+    static DownloadManager::Priority ParsePriority(const std::string& name) {
+      if (name == "visible")
+        return DownloadManager::kPriorityVisible;
+      if (name == "prefetch")
+        return DownloadManager::kPriorityPrefetch;
+      return DownloadManager::kPriorityNormal;
+    }
+
+    void PostDownloadStats() {
+      DownloadManager::Stats stats = download_manager_.GetStats();
+      StringVector sv;
       std::stringstream ss;
+      ss << stats.queued;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.active;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.completed;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.failed;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.joined;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.bytes;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << static_cast<int64_t>(stats.bytes_per_second);
+      sv.push_back(ss.str());
+      PostArrayMessage("URLLOADER", "STATS", sv);
+      // Per-origin timing, to tell slow transfers from slow decoding.
+      PostArrayMessage("URLLOADER", "HISTOGRAMS", download_manager_.telemetry().Describe());
+    }
+
+    void PostCacheStats() {
+      ImageCache::Stats stats = image_cache_->GetStats();
       StringVector sv;
-      ss << 3000;
+      std::stringstream ss;
+      ss << stats.hits;
       sv.push_back(ss.str());
       ss.str("");
-      ss << 3000;
+      ss << stats.misses;
       sv.push_back(ss.str());
-      PostArrayMessage("GRAPHICS", "WH", sv);
+      ss.str("");
+      ss << stats.evictions;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.entries;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.bytes;
+      sv.push_back(ss.str());
+      ss.str("");
+      ss << stats.budget_bytes;
+      sv.push_back(ss.str());
+      PostArrayMessage("CACHE", "STATS", sv);
+    }
 
-      PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
-      const bool kDontInitToZero = false;
-      image_data = pp::ImageData (this, format, new_size, kDontInitToZero);
-      data = static_cast<uint32_t*>(image_data.data());
-      if (!data) return;
+    // Reads just enough of |ref| to learn the size of the image in it.
+    bool MeasureImage(int32_t request_id, const pp::FileRef& ref, pp::Size* image_size) {
+      pp::FileIO file(this);
+      int32_t open_result =
+        file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete());
+      if (open_result != PP_OK) {
+        ShowErrorMessage(request_id, "File open for read failed", open_result);
+        return false;
+      }
+      char header[BmpDecoder::kHeaderSize];
+      int32_t header_size = 0;
+      while (header_size < static_cast<int32_t>(sizeof(header))) {
+        int32_t bytes_read = file.Read(header_size,
+            header + header_size,
+            sizeof(header) - header_size,
+            pp::BlockUntilComplete());
+        if (bytes_read <= 0)
+          break;
+        header_size += bytes_read;
+      }
+      file.Close();
 
-      uint32_t width_offset = 0;
+      int32_t width = 0;
+      int32_t height = 0;
+      if (!BmpDecoder::ReadSize(header, header_size, &width, &height)) {
+        ShowErrorMessage(request_id, "Not a supported BMP image", PP_ERROR_BADARGUMENT);
+        return false;
+      }
+      *image_size = pp::Size(width, height);
+      return true;
+    }
 
-      for (int i = 0 ; i < entries.size() ; i ++) {
-        pp::FileIO file(this);
-        pp::FileRef ref = entries[i].file_ref();
-        int32_t open_result =
-          file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete());
-        if (open_result == PP_ERROR_FILENOTFOUND) {
-          ShowErrorMessage("File not found", open_result);
-          return;
-        } else if (open_result != PP_OK) {
-          ShowErrorMessage("File open for read failed", open_result);
-          return;
-        }
-        PP_FileInfo info;
-        int32_t query_result = file.Query(&info, pp::BlockUntilComplete());
-        if (query_result != PP_OK) {
-          ShowErrorMessage("File query failed", query_result);
-          return;
-        }
-        // FileIO.Read() can only handle int32 sizes
-        if (info.size > INT32_MAX) {
-          ShowErrorMessage("File too big", PP_ERROR_FILETOOBIG);
-          return;
-        }
+    bool ReadWholeFile(int32_t request_id, const pp::FileRef& ref, std::vector<char>* filedata) {
+      pp::FileIO file(this);
+      int32_t open_result =
+        file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete());
+      if (open_result == PP_ERROR_FILENOTFOUND) {
+        ShowErrorMessage(request_id, "File not found", open_result);
+        return false;
+      } else if (open_result != PP_OK) {
+        ShowErrorMessage(request_id, "File open for read failed", open_result);
+        return false;
+      }
+      PP_FileInfo info;
+      int32_t query_result = file.Query(&info, pp::BlockUntilComplete());
+      if (query_result != PP_OK) {
+        ShowErrorMessage(request_id, "File query failed", query_result);
+        return false;
+      }
+      // FileIO.Read() can only handle int32 sizes
+      if (info.size > INT32_MAX) {
+        ShowErrorMessage(request_id, "File too big", PP_ERROR_FILETOOBIG);
+        return false;
+      }
+      if (info.size == 0) {
+        ShowErrorMessage(request_id, "File is empty", PP_ERROR_FAILED);
+        return false;
+      }
 
-        std::vector<char> filedata(info.size);
-        int64_t offset = 0;
-        int32_t bytes_read = 0;
-        int32_t bytes_to_read = info.size;
-        while (bytes_to_read > 0) {
-          bytes_read = file.Read(offset,
-              &filedata[offset],
-              filedata.size() - offset,
-              pp::BlockUntilComplete());
-          if (bytes_read > 0) {
-            offset += bytes_read;
-            bytes_to_read -= bytes_read;
-          } else if (bytes_read < 0) {
-            // If bytes_read < PP_OK then it indicates the error code.
-            ShowErrorMessage("File read failed", bytes_read);
-            return;
-          }
-        }
-        int len = filedata.size();
-        if (array_) {
-          delete[] array_;
-          array_ = NULL;
-        }
-        array_ = new uint32_t[len];
-        for (int i = 0 ; i < len ; i ++) {
-          int c = (unsigned char) filedata[i];
-          array_[i] = (uint32_t) c;
+      filedata->resize(info.size);
+      int64_t offset = 0;
+      int32_t bytes_read = 0;
+      int32_t bytes_to_read = info.size;
+      while (bytes_to_read > 0) {
+        bytes_read = file.Read(offset,
+            &(*filedata)[offset],
+            filedata->size() - offset,
+            pp::BlockUntilComplete());
+        if (bytes_read > 0) {
+          offset += bytes_read;
+          bytes_to_read -= bytes_read;
+        } else if (bytes_read < 0) {
+          // If bytes_read < PP_OK then it indicates the error code.
+          ShowErrorMessage(request_id, "File read failed", bytes_read);
+          return false;
+        } else {
+          // The file got shorter since it was queried.
+          filedata->resize(offset);
+          break;
         }
-        // Done reading, send content to the user interface
-        ShowStatusMessage(ref.GetName().AsString());
-        ShowStatusMessage("Load success");
-       /* 
-        pp::Size new_size = pp::Size (3000, 3000);
-        CreateContext (new_size);
-
-        std::stringstream ss;
-        StringVector sv;
-        ss << 3000;
-        sv.push_back(ss.str());
-        ss.str("");
-        ss << 3000;
-        sv.push_back(ss.str());
-        PostArrayMessage("GRAPHICS", "WH", sv);
-
-        PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
-        const bool kDontInitToZero = false;
-        image_data = pp::ImageData (this, format, new_size, kDontInitToZero);
-        data = static_cast<uint32_t*>(image_data.data());
-        if (!data) return;
-       */
-        width_offset += 10;
-        UpdateWithArray (array_, width_offset, 10);
-        width_offset += GetArrayValue (array_, 18, 4);
-        file.Close();  
       }
-      context_.Flush(callback_factory_.NewCallback(&FileIoUrlLoaderInstance::Nop));
+      file.Close();
+      return !filedata->empty();
     }
 
-    void ListCallback(int32_t result,
-        const std::vector<pp::DirectoryEntry>& entries,
-        pp::FileRef ) {
+    int32_t ListCallback(int32_t request_id, int32_t result,
+        const std::vector<pp::DirectoryEntry>& entries) {
       if (result != PP_OK) {
-        ShowErrorMessage("List failed", result);
-        return;
+        ShowErrorMessage(request_id, "List failed", result);
+        return result;
       }
 
       StringVector sv;
@@ -663,33 +1434,35 @@ class FileIoUrlLoaderInstance : public pp::Instance {
           sv.push_back(name.AsString());
         }
       }
-      PostArrayMessage("FILEIO", "LIST", sv);
-      ShowStatusMessage("List success");
+      PostArrayMessage("FILEIO", "LIST", request_id, sv);
+      ShowStatusMessage(request_id, "List success");
+      return PP_OK;
     }
 
-    void MakeDir(int32_t, const std::string& dir_name) {
+    int32_t MakeDir(int32_t request_id, const std::string& dir_name) {
       if (!file_system_ready_) {
-        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-        return;
+        ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
       }
       pp::FileRef ref(file_system_, dir_name.c_str());
 
       int32_t result = ref.MakeDirectory(
           PP_MAKEDIRECTORYFLAG_NONE, pp::BlockUntilComplete());
       if (result != PP_OK) {
-        ShowErrorMessage("Make directory failed", result);
-        return;
+        ShowErrorMessage(request_id, "Make directory failed", result);
+        return result;
       }
-      ShowStatusMessage("Make directory success");
+      ShowStatusMessage(request_id, "Make directory success");
+      return PP_OK;
     }
 
     /*
-    void Rename(int32_t,
+    int32_t Rename(int32_t request_id,
         const std::string& old_name,
         const std::string& new_name) {
       if (!file_system_ready_) {
-        ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-        return;
+        ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+        return PP_ERROR_FAILED;
       }
 
       pp::FileRef ref_old(file_system_, old_name.c_str());
@@ -697,22 +1470,44 @@ class FileIoUrlLoaderInstance : public pp::Instance {
 
       int32_t result = ref_old.Rename(ref_new, pp::BlockUntilComplete());
       if (result != PP_OK) {
-        ShowErrorMessage("Rename failed", result);
-        return;
+        ShowErrorMessage(request_id, "Rename failed", result);
+        return result;
       }
-      ShowStatusMessage("Rename success");
+      ShowStatusMessage(request_id, "Rename success");
+      return PP_OK;
     }
     */
 
     /// Encapsulates our simple javascript communication protocol
-    void ShowErrorMessage(const std::string& message, int32_t result) {
+    void ShowErrorMessage(int32_t request_id, const std::string& message, int32_t result) {
       std::stringstream ss;
       ss << message << " -- Error #: " << result;
-      PostArrayMessage("FILEIO", "ERR", ss.str());
+      PostArrayMessage("FILEIO", "ERR", request_id, StringVector(1, ss.str()));
+    }
+
+    void ShowErrorMessage(const std::string& message, int32_t result) {
+      ShowErrorMessage(kNoRequestId, message, result);
+    }
+
+    void ShowStatusMessage(int32_t request_id, const std::string& message) {
+      PostArrayMessage("FILEIO", "STAT", request_id, StringVector(1, message));
     }
 
     void ShowStatusMessage(const std::string& message) {
-      PostArrayMessage("FILEIO", "STAT", message);
+      ShowStatusMessage(kNoRequestId, message);
+    }
+
+    // Ends a FILEIO request with its result: PP_OK or the error met.
+    // Requests without an id get no DONE, as before ids were introduced.
+    void PostDone(int32_t request_id, int32_t result) {
+      if (request_id == kNoRequestId)
+        return;
+      pp::VarArray message;
+      message.Set(0, "FILEIO");
+      message.Set(1, "DONE");
+      message.Set(2, request_id);
+      message.Set(3, result);
+      PostMessage(message);
     }
 };
 
@@ -721,15 +1516,21 @@ class FileIoUrlLoaderInstance : public pp::Instance {
 /// instance for each <embed> tag with type="application/x-nacl".
 class FileIoUrlLoaderModule : public pp::Module {
   public:
-    FileIoUrlLoaderModule() : pp::Module() {}
+    FileIoUrlLoaderModule() : pp::Module(), image_cache_(kImageCacheBytes) {}
     virtual ~FileIoUrlLoaderModule() {}
 
     /// Create and return a FileIoInstance object.
     /// @param[in] instance The browser-side instance.
     /// @return the plugin-side instance.
     virtual pp::Instance* CreateInstance(PP_Instance instance) {
-      return new FileIoUrlLoaderInstance(instance);
+      return new FileIoUrlLoaderInstance(instance, &image_cache_, &flights_);
     }
+
+  private:
+    // Decoded images, shared by all instances.
+    ImageCache image_cache_;
+    // Loads and downloads under way, joined by the requests of any instance.
+    SingleFlight flights_;
 };
 
 namespace pp {
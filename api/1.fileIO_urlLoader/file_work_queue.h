@@ -0,0 +1,93 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef FILE_WORK_QUEUE_H_
+#define FILE_WORK_QUEUE_H_
+
+#include <pthread.h>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/utility/threading/simple_thread.h"
+
+// FileWorkQueue runs file operations on a few pp::SimpleThreads, each with
+// its own pp::MessageLoop, so the work may block on pp::BlockUntilComplete()
+// as it would on a single file thread.  Work waits in one queue until a
+// thread is free, and the next to run is picked:
+//  - by priority, so an interactive read does not wait behind bulk writes;
+//  - in order within a key (the path of the file worked on, say): work on a
+//    key starts once all earlier work on it has finished, whatever its
+//    priority, so operations on one file see each other's results.
+// Exclusive work runs alone, after all work posted before it and before
+// any posted after it, as opening the file system must.
+//
+// Work must be finished when its callback returns; a callback that leaves
+// an asynchronous call running should wait for it with a blocking callback.
+//
+// EXAMPLE USAGE:
+// FileWorkQueue queue(instance, 3);
+// queue.PostExclusiveWork(factory.NewCallback(&MyInstance::OpenFileSystem));
+// queue.Start();
+// queue.PostWork("/a.txt", FileWorkQueue::kPriorityBulk,
+//     factory.NewCallback(&MyInstance::Save, ...));
+//
+class FileWorkQueue {
+  public:
+    enum Priority {
+      kPriorityInteractive,  // The user waits for it: loads, listings.
+      kPriorityNormal,
+      kPriorityBulk,         // Large writes nobody waits to see.
+      kPriorityCount
+    };
+
+    FileWorkQueue(const pp::InstanceHandle& instance, int thread_count);
+    // Calls Join() if it has not been called.
+    ~FileWorkQueue();
+
+    // Work may be posted before; it runs from now on.
+    void Start();
+    // Lets running work finish, runs the work still waiting in the order it
+    // was posted on one thread, and joins the threads.  No work may be
+    // posted afterwards.
+    void Join();
+    int thread_count() const { return static_cast<int>(workers_.size()); }
+
+    // Queues |callback| to run after earlier work on |key|.  May be called
+    // from any thread.  Returns PP_OK, or an error if the queue is shutting
+    // down, in which case |callback| is never run.
+    int32_t PostWork(const std::string& key, Priority priority,
+        const pp::CompletionCallback& callback);
+    // Queues |callback| to run with no other work running.
+    int32_t PostExclusiveWork(const pp::CompletionCallback& callback);
+
+  private:
+    struct Work;
+    struct Worker;
+
+    int32_t Post(Work* work);
+    // Starts waiting work on the idle threads.  Called with lock_ held.
+    void Dispatch();
+    // The work to start next, taken off pending_, or NULL if none may start
+    // yet.  Called with lock_ held.
+    Work* TakeNext();
+    static void RunWork(void* user_data, int32_t result);
+
+    std::vector<Worker*> workers_;
+    pthread_mutex_t lock_;
+    // Everything below is guarded by lock_.
+    bool started_;
+    bool stopping_;
+    std::deque<Work*> pending_;
+    std::set<std::string> running_keys_;
+    int running_count_;
+    bool exclusive_running_;
+
+    FileWorkQueue(const FileWorkQueue&);
+    void operator=(const FileWorkQueue&);
+};
+
+#endif  // FILE_WORK_QUEUE_H_
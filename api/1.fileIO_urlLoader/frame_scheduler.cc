@@ -0,0 +1,140 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/module.h"
+
+#include "frame_scheduler.h"
+
+FrameScheduler::FrameScheduler(pp::Instance* instance, Client* client)
+: instance_(instance),
+  client_(client),
+  callback_factory_(this),
+  back_(0),
+  scale_(1.0f),
+  size_changed_(false),
+  frame_scheduled_(false),
+  flush_pending_(false) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+FrameScheduler::~FrameScheduler() {
+  pthread_mutex_destroy(&lock_);
+}
+
+void FrameScheduler::SetSize(const pp::Size& size, float scale) {
+  pthread_mutex_lock(&lock_);
+  size_ = size;
+  scale_ = scale;
+  size_changed_ = true;
+  InvalidateLocked(pp::Rect(size));
+  pthread_mutex_unlock(&lock_);
+}
+
+void FrameScheduler::Invalidate(const pp::Rect& rect) {
+  pthread_mutex_lock(&lock_);
+  InvalidateLocked(rect);
+  pthread_mutex_unlock(&lock_);
+}
+
+void FrameScheduler::InvalidateLocked(const pp::Rect& rect) {
+  damage_.Add(rect.Intersect(pp::Rect(size_)));
+  if (!damage_.IsEmpty() || size_changed_)
+    ScheduleFrame();
+}
+
+void FrameScheduler::ScheduleFrame() {
+  // While a flush is in flight OnFlushComplete() picks the damage up.
+  if (frame_scheduled_ || flush_pending_)
+    return;
+  frame_scheduled_ = true;
+  pp::Module::Get()->core()->CallOnMainThread(0,
+      callback_factory_.NewCallback(&FrameScheduler::RenderFrame));
+}
+
+void FrameScheduler::RenderFrame(int32_t /* result */) {
+  pthread_mutex_lock(&lock_);
+  frame_scheduled_ = false;
+  DirtyRegion damage = damage_;
+  damage_.Clear();
+  bool size_changed = size_changed_;
+  size_changed_ = false;
+  pp::Size size = size_;
+  float scale = scale_;
+  pthread_mutex_unlock(&lock_);
+
+  if (size_changed && !RecreateContext(size, scale))
+    return;
+  if (context_.is_null() || damage.IsEmpty())
+    return;
+
+  // The back frame misses the damage of every frame shown since it was
+  // last drawn, and the front frame is about to miss this one.
+  DirtyRegion repaint = stale_[back_];
+  repaint.Add(damage);
+  for (size_t i = 0; i < repaint.rect_count(); i++)
+    client_->ComposeFrame(&frames_[back_], repaint.rect(i));
+  stale_[back_].Clear();
+  stale_[1 - back_].Add(damage);
+
+  // ReplaceContents() resets the ImageData it is given; hand it a copy of
+  // the handle so the buffer can be reused two frames from now.
+  pp::ImageData frame = frames_[back_];
+  context_.ReplaceContents(&frame);
+  back_ = 1 - back_;
+
+  pthread_mutex_lock(&lock_);
+  flush_pending_ = true;
+  pthread_mutex_unlock(&lock_);
+  context_.Flush(callback_factory_.NewCallback(&FrameScheduler::OnFlushComplete));
+}
+
+void FrameScheduler::OnFlushComplete(int32_t /* result */) {
+  // The frame that was on screen before the flush is free again.
+  pthread_mutex_lock(&lock_);
+  flush_pending_ = false;
+  bool more = !damage_.IsEmpty() || size_changed_;
+  // Keep other threads from scheduling a frame of their own meanwhile.
+  frame_scheduled_ = more;
+  pthread_mutex_unlock(&lock_);
+  if (more)
+    RenderFrame(PP_OK);
+}
+
+bool FrameScheduler::RecreateContext(const pp::Size& size, float scale) {
+  context_ = pp::Graphics2D();
+  frames_[0] = pp::ImageData();
+  frames_[1] = pp::ImageData();
+  if (size.IsEmpty())
+    return false;
+
+  const bool kIsAlwaysOpaque = false;
+  pp::Graphics2D context(instance_, size, kIsAlwaysOpaque);
+  // Call SetScale before BindGraphics so the image is scaled correctly on
+  // HiDPI displays.
+  context.SetScale(1.0f / scale);
+  if (!instance_->BindGraphics(context)) {
+    fprintf(stderr, "Unable to bind 2d context!\n");
+    return false;
+  }
+
+  const bool kDontInitToZero = false;
+  PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
+  for (int i = 0; i < 2; i++) {
+    frames_[i] = pp::ImageData(instance_, format, size, kDontInitToZero);
+    if (frames_[i].is_null()) {
+      frames_[0] = pp::ImageData();
+      frames_[1] = pp::ImageData();
+      return false;
+    }
+    // Neither frame holds anything yet.
+    stale_[i].Clear();
+    stale_[i].Add(pp::Rect(size));
+  }
+  back_ = 0;
+  context_ = context;
+  return true;
+}
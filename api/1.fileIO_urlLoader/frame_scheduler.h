@@ -0,0 +1,88 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef FRAME_SCHEDULER_H_
+#define FRAME_SCHEDULER_H_
+
+#include <pthread.h>
+#include "ppapi/cpp/graphics_2d.h"
+#include "ppapi/cpp/image_data.h"
+#include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/rect.h"
+#include "ppapi/cpp/size.h"
+#include "ppapi/utility/completion_callback_factory.h"
+
+#include "dirty_region.h"
+
+// FrameScheduler owns the Graphics2D context of an instance and shows frames
+// with ReplaceContents(), so the browser never copies painted pixels into a
+// backing store of its own.
+//
+// Two frame buffers are recycled: while one is on screen, the other is
+// brought up to date and swapped in.  Only the parts that changed since a
+// buffer was last shown are redrawn into it; they are tracked as a few
+// disjoint rectangles, so a frame costs in proportion to the pixels that
+// changed rather than to the number of Invalidate() calls.
+//
+// Invalidate() may be called from any thread, as often as needed.  All the
+// requests made while a flush is in flight are merged and drawn as a single
+// frame when the flush completes, so there is at most one Flush() per
+// display frame and none is ever dropped.  Frames are drawn and flushed on
+// the main thread only.
+//
+class FrameScheduler {
+  public:
+    class Client {
+      public:
+        // Called on the main thread to draw |rect| of the next frame into
+        // |frame|, which has the size given to SetSize().
+        virtual void ComposeFrame(pp::ImageData* frame, const pp::Rect& rect) = 0;
+
+      protected:
+        virtual ~Client() {}
+    };
+
+    FrameScheduler(pp::Instance* instance, Client* client);
+    ~FrameScheduler();
+
+    // Sets the size of the frames (and of the context) and redraws them in
+    // full.  May be called from any thread; takes effect with the next frame.
+    void SetSize(const pp::Size& size, float scale);
+
+    // Marks |rect| as changed.  May be called from any thread.
+    void Invalidate(const pp::Rect& rect);
+
+  private:
+    // Both are called with lock_ held.
+    void ScheduleFrame();
+    void InvalidateLocked(const pp::Rect& rect);
+
+    void RenderFrame(int32_t result);
+    void OnFlushComplete(int32_t result);
+    bool RecreateContext(const pp::Size& size, float scale);
+
+    pp::Instance* instance_;  // Weak pointer.
+    Client* client_;          // Weak pointer.
+    pp::CompletionCallbackFactory<FrameScheduler> callback_factory_;
+
+    // Only used on the main thread.
+    pp::Graphics2D context_;
+    pp::ImageData frames_[2];
+    DirtyRegion stale_[2];  // Part of each frame older than the screen.
+    int back_;              // Index of the frame drawn next.
+
+    // Shared with other threads, guarded by lock_.
+    pthread_mutex_t lock_;
+    pp::Size size_;
+    float scale_;
+    bool size_changed_;
+    DirtyRegion damage_;   // Changes not drawn into any frame yet.
+    bool frame_scheduled_;
+    bool flush_pending_;
+
+    FrameScheduler(const FrameScheduler&);
+    void operator=(const FrameScheduler&);
+};
+
+#endif  // FRAME_SCHEDULER_H_
@@ -0,0 +1,101 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "image_cache.h"
+
+DecodedImage::DecodedImage(int32_t width, int32_t height)
+: ref_count_(1),
+  width_(width),
+  height_(height),
+  pixels_(static_cast<size_t>(width) * height) {}
+
+void DecodedImage::AddRef() {
+  __sync_fetch_and_add(&ref_count_, 1);
+}
+
+void DecodedImage::Release() {
+  if (__sync_sub_and_fetch(&ref_count_, 1) == 0)
+    delete this;
+}
+
+ImageCache::ImageCache(size_t budget_bytes)
+: budget_bytes_(budget_bytes),
+  bytes_(0),
+  hits_(0),
+  misses_(0),
+  evictions_(0) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+ImageCache::~ImageCache() {
+  for (EntryList::iterator it = entries_.begin(); it != entries_.end(); ++it)
+    it->image->Release();
+  pthread_mutex_destroy(&lock_);
+}
+
+DecodedImage* ImageCache::Lookup(const std::string& path,
+    double modified_time) {
+  DecodedImage* image = NULL;
+  pthread_mutex_lock(&lock_);
+  std::map<Key, EntryList::iterator>::iterator found =
+    index_.find(Key(path, modified_time));
+  if (found != index_.end()) {
+    // Move the entry to the front; list iterators stay valid.
+    entries_.splice(entries_.begin(), entries_, found->second);
+    image = found->second->image;
+    image->AddRef();
+    hits_++;
+  } else {
+    misses_++;
+  }
+  pthread_mutex_unlock(&lock_);
+  return image;
+}
+
+void ImageCache::Insert(const std::string& path, double modified_time,
+    DecodedImage* image) {
+  if (!Fits(image->byte_size()))
+    return;
+  Key key(path, modified_time);
+  image->AddRef();
+  pthread_mutex_lock(&lock_);
+  std::map<Key, EntryList::iterator>::iterator found = index_.find(key);
+  if (found != index_.end()) {
+    // Another viewer decoded the same file meanwhile; keep the newer copy.
+    bytes_ -= found->second->image->byte_size();
+    found->second->image->Release();
+    entries_.erase(found->second);
+    index_.erase(found);
+  }
+  Entry entry = { key, image };
+  entries_.push_front(entry);
+  index_[key] = entries_.begin();
+  bytes_ += image->byte_size();
+  EvictToBudget();
+  pthread_mutex_unlock(&lock_);
+}
+
+ImageCache::Stats ImageCache::GetStats() {
+  pthread_mutex_lock(&lock_);
+  Stats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  stats.entries = static_cast<uint32_t>(entries_.size());
+  stats.bytes = bytes_;
+  stats.budget_bytes = budget_bytes_;
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+void ImageCache::EvictToBudget() {
+  while (bytes_ > budget_bytes_ && !entries_.empty()) {
+    Entry& victim = entries_.back();
+    bytes_ -= victim.image->byte_size();
+    index_.erase(victim.key);
+    victim.image->Release();
+    entries_.pop_back();
+    evictions_++;
+  }
+}
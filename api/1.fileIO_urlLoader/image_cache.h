@@ -0,0 +1,113 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef IMAGE_CACHE_H_
+#define IMAGE_CACHE_H_
+
+#include <pthread.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+
+// DecodedImage holds the pixels of one image in native ImageData format.
+// It is reference counted so the cache can evict an image while a viewer is
+// still drawing it; whoever gets one from the cache must call Release().
+class DecodedImage {
+  public:
+    // The new image has one reference, owned by the caller.
+    DecodedImage(int32_t width, int32_t height);
+
+    void AddRef();
+    void Release();
+
+    int32_t width() const { return width_; }
+    int32_t height() const { return height_; }
+    size_t byte_size() const { return pixels_.size() * sizeof(uint32_t); }
+
+    uint32_t* GetRow(int32_t y) { return &pixels_[y * width_]; }
+    const uint32_t* GetRow(int32_t y) const { return &pixels_[y * width_]; }
+
+  private:
+    ~DecodedImage() {}
+
+    volatile int32_t ref_count_;
+    int32_t width_;
+    int32_t height_;
+    std::vector<uint32_t> pixels_;
+
+    DecodedImage(const DecodedImage&);
+    void operator=(const DecodedImage&);
+};
+
+// ImageCache is a least-recently-used cache of decoded images, bounded by the
+// number of pixel bytes it holds.  It is owned by the module and shared by
+// all instances, from any thread.
+//
+// Entries are keyed by file path and last modification time, so an image
+// that changed on disk is simply a miss; its stale entry ages out.
+//
+// EXAMPLE USAGE:
+// DecodedImage* image = cache->Lookup(path, info.last_modified_time);
+// if (!image) {
+//   image = Decode(...);
+//   cache->Insert(path, info.last_modified_time, image);
+// }
+// Draw(image);
+// image->Release();
+//
+class ImageCache {
+  public:
+    struct Stats {
+      uint32_t hits;
+      uint32_t misses;
+      uint32_t evictions;
+      uint32_t entries;
+      size_t bytes;
+      size_t budget_bytes;
+    };
+
+    explicit ImageCache(size_t budget_bytes);
+    ~ImageCache();
+
+    // Returns the image cached for |path| at |modified_time| with a reference
+    // added for the caller, or NULL.  Counts a hit or a miss.
+    DecodedImage* Lookup(const std::string& path, double modified_time);
+
+    // Adds |image| (taking a reference of its own) and evicts the least
+    // recently used images until the cache fits its budget again.  Images
+    // bigger than the whole budget are not cached.
+    void Insert(const std::string& path, double modified_time,
+        DecodedImage* image);
+
+    // True if an image of |byte_size| bytes would be kept by Insert().
+    bool Fits(size_t byte_size) const { return byte_size <= budget_bytes_; }
+
+    Stats GetStats();
+
+  private:
+    typedef std::pair<std::string, double> Key;
+    struct Entry {
+      Key key;
+      DecodedImage* image;
+    };
+    typedef std::list<Entry> EntryList;  // Most recently used first.
+
+    void EvictToBudget();
+
+    size_t budget_bytes_;
+    size_t bytes_;
+    uint32_t hits_;
+    uint32_t misses_;
+    uint32_t evictions_;
+    EntryList entries_;
+    std::map<Key, EntryList::iterator> index_;
+    pthread_mutex_t lock_;
+
+    ImageCache(const ImageCache&);
+    void operator=(const ImageCache&);
+};
+
+#endif  // IMAGE_CACHE_H_
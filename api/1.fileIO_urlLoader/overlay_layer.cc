@@ -0,0 +1,64 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+
+#include "overlay_layer.h"
+
+namespace {
+  // Blends the colour channels of |color| over |pixel| with opacity |alpha|.
+  // Red and blue are blended together in the 0x00FF00FF lanes; the byte
+  // order of the native format does not matter.
+  inline uint32_t Blend(uint32_t color, uint32_t pixel, uint32_t alpha) {
+    const uint32_t inverse = 255 - alpha;
+    uint32_t rb = (color & 0x00FF00FFu) * alpha +
+      (pixel & 0x00FF00FFu) * inverse + 0x00800080u;
+    rb = ((rb + ((rb >> 8) & 0x00FF00FFu)) >> 8) & 0x00FF00FFu;
+    uint32_t g = (color & 0x0000FF00u) * alpha +
+      (pixel & 0x0000FF00u) * inverse + 0x00008000u;
+    g = ((g + ((g >> 8) & 0x0000FF00u)) >> 8) & 0x0000FF00u;
+    return 0xFF000000u | rb | g;
+  }
+}
+
+OverlayLayer::OverlayLayer() {}
+
+void OverlayLayer::Clear() {
+  spans_.clear();
+  bounds_ = pp::Rect();
+}
+
+void OverlayLayer::AddSpan(int32_t x, int32_t y, int32_t width,
+    uint32_t color, uint8_t coverage) {
+  if (width <= 0 || coverage == 0)
+    return;
+  Span span = { x, y, width, color, coverage };
+  spans_.push_back(span);
+  bounds_ = bounds_.Union(pp::Rect(x, y, width, 1));
+}
+
+void OverlayLayer::CompositeInto(const pp::Rect& region,
+    uint32_t* pixels, int32_t stride) const {
+  if (!region.Intersects(bounds_))
+    return;
+  // Later spans are drawn over earlier ones.
+  for (size_t i = 0; i < spans_.size(); ++i) {
+    const Span& span = spans_[i];
+    if (span.y < region.y() || span.y >= region.bottom())
+      continue;
+    int32_t begin = std::max(span.x, region.x());
+    int32_t end = std::min(span.x + span.width, region.right());
+    if (begin >= end)
+      continue;
+    uint32_t* row = reinterpret_cast<uint32_t*>(
+        reinterpret_cast<uint8_t*>(pixels) + (span.y - region.y()) * stride);
+    if (span.coverage == 255) {
+      std::fill(row + begin - region.x(), row + end - region.x(), span.color);
+      continue;
+    }
+    for (uint32_t* pixel = row + begin - region.x();
+        pixel != row + end - region.x(); ++pixel)
+      *pixel = Blend(span.color, *pixel, span.coverage);
+  }
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef OVERLAY_LAYER_H_
+#define OVERLAY_LAYER_H_
+
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/rect.h"
+
+// OverlayLayer holds annotations (such as the measurement line drawn by the
+// mouse) apart from the decoded images.  The images are never written to;
+// the overlay is composited on top of them only when a region is painted, so
+// annotations can be cleared without decoding anything again.
+//
+// The layer is sparse: it stores horizontal runs of native-format pixels,
+// which is what line and shape drawing produces.  Each run has a coverage so
+// antialiased edges blend with the images below.
+class OverlayLayer {
+  public:
+    OverlayLayer();
+
+    void Clear();
+    bool empty() const { return spans_.empty(); }
+
+    // Bounding box of everything drawn so far.
+    const pp::Rect& bounds() const { return bounds_; }
+
+    // Covers pixels [x, x + width) of row |y| with |color|, a native pixel.
+    // |coverage| is the opacity of the run, 255 replacing what is below.
+    void AddSpan(int32_t x, int32_t y, int32_t width, uint32_t color,
+        uint8_t coverage = 255);
+
+    // Writes the overlay pixels that fall inside |region| into |pixels|.
+    // |pixels| holds the region only: its first row is region.y(), its first
+    // column region.x(), and rows are |stride| bytes apart.
+    void CompositeInto(const pp::Rect& region,
+        uint32_t* pixels, int32_t stride) const;
+
+  private:
+    struct Span {
+      int32_t x;
+      int32_t y;
+      int32_t width;
+      uint32_t color;
+      uint8_t coverage;
+    };
+
+    std::vector<Span> spans_;
+    pp::Rect bounds_;
+};
+
+#endif  // OVERLAY_LAYER_H_
@@ -0,0 +1,178 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pixel_converter.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PIXEL_CONVERTER_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXEL_CONVERTER_SSE2 1
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXEL_CONVERTER_NEON 1
+#endif
+
+// All kernels write little-endian 32-bit pixels: the byte order in memory is
+// the source order followed by alpha.  Every NaCl target is little-endian.
+
+namespace {
+  const uint32_t kOpaque = 0xFF000000u;
+
+  void CopyRowScalar(const uint8_t* src, uint32_t* dst, int32_t count) {
+    for (int32_t i = 0; i < count; ++i, src += 3)
+      dst[i] = kOpaque | (src[2] << 16) | (src[1] << 8) | src[0];
+  }
+
+  void SwapRowScalar(const uint8_t* src, uint32_t* dst, int32_t count) {
+    for (int32_t i = 0; i < count; ++i, src += 3)
+      dst[i] = kOpaque | (src[0] << 16) | (src[1] << 8) | src[2];
+  }
+
+#if defined(PIXEL_CONVERTER_AVX2)
+  // 8 pixels per iteration: each 128-bit lane shuffles 4 packed pixels into
+  // 4 words.  A lane loads 16 bytes for the 12 it uses, so stop while at
+  // least 10 pixels are left to avoid reading past the row.
+  void ShuffleRowAVX2(const uint8_t* src, uint32_t* dst, int32_t count,
+      __m256i mask, void (*tail)(const uint8_t*, uint32_t*, int32_t)) {
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(kOpaque));
+    int32_t i = 0;
+    for (; i + 10 <= count; i += 8, src += 24) {
+      __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+      __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+      __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+      v = _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+    }
+    tail(src, dst + i, count - i);
+  }
+
+  void CopyRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    const __m256i mask = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    ShuffleRowAVX2(src, dst, count, mask, CopyRowScalar);
+  }
+
+  void SwapRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    const __m256i mask = _mm256_setr_epi8(
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    ShuffleRowAVX2(src, dst, count, mask, SwapRowScalar);
+  }
+#elif defined(PIXEL_CONVERTER_SSE2)
+  // SSE2 has no byte shuffle, so spread 4 packed pixels over 4 words with
+  // whole-register byte shifts: shifting left by k moves pixel k into word k.
+  // 16 bytes are loaded for the 12 used; stop while 6 pixels are left.
+  inline __m128i UnpackFourSSE2(const uint8_t* src) {
+    const __m128i low3 = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i word0 = _mm_setr_epi32(-1, 0, 0, 0);
+    const __m128i word1 = _mm_setr_epi32(0, -1, 0, 0);
+    const __m128i word2 = _mm_setr_epi32(0, 0, -1, 0);
+    const __m128i word3 = _mm_setr_epi32(0, 0, 0, -1);
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i out = _mm_and_si128(v, word0);
+    out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 1), word1));
+    out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 2), word2));
+    out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 3), word3));
+    return _mm_and_si128(out, low3);
+  }
+
+  void CopyRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(kOpaque));
+    int32_t i = 0;
+    for (; i + 6 <= count; i += 4, src += 12) {
+      __m128i v = _mm_or_si128(UnpackFourSSE2(src), alpha);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+    CopyRowScalar(src, dst + i, count - i);
+  }
+
+  void SwapRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    const __m128i alpha_green = _mm_set1_epi32(static_cast<int>(0xFF00FF00u));
+    const __m128i low_byte = _mm_set1_epi32(0x000000FF);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(kOpaque));
+    int32_t i = 0;
+    for (; i + 6 <= count; i += 4, src += 12) {
+      __m128i v = UnpackFourSSE2(src);
+      __m128i red_blue = _mm_or_si128(
+          _mm_and_si128(_mm_srli_epi32(v, 16), low_byte),
+          _mm_slli_epi32(_mm_and_si128(v, low_byte), 16));
+      v = _mm_or_si128(_mm_and_si128(v, alpha_green), red_blue);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+          _mm_or_si128(v, alpha));
+    }
+    SwapRowScalar(src, dst + i, count - i);
+  }
+#elif defined(PIXEL_CONVERTER_NEON)
+  // NEON de-interleaves 16 packed pixels and re-interleaves them with alpha.
+  void CopyRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+    int32_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 48) {
+      uint8x16x3_t in = vld3q_u8(src);
+      uint8x16x4_t px;
+      px.val[0] = in.val[0];
+      px.val[1] = in.val[1];
+      px.val[2] = in.val[2];
+      px.val[3] = vdupq_n_u8(255);
+      vst4q_u8(out + i * 4, px);
+    }
+    CopyRowScalar(src, dst + i, count - i);
+  }
+
+  void SwapRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+    int32_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 48) {
+      uint8x16x3_t in = vld3q_u8(src);
+      uint8x16x4_t px;
+      px.val[0] = in.val[2];
+      px.val[1] = in.val[1];
+      px.val[2] = in.val[0];
+      px.val[3] = vdupq_n_u8(255);
+      vst4q_u8(out + i * 4, px);
+    }
+    SwapRowScalar(src, dst + i, count - i);
+  }
+#else
+  void CopyRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    CopyRowScalar(src, dst, count);
+  }
+
+  void SwapRowSIMD(const uint8_t* src, uint32_t* dst, int32_t count) {
+    SwapRowScalar(src, dst, count);
+  }
+#endif
+}
+
+PixelConverter::PixelConverter()
+: format_(PP_IMAGEDATAFORMAT_BGRA_PREMUL),
+  same_order_kernel_(CopyRowSIMD),
+  swapped_order_kernel_(SwapRowSIMD) {}
+
+PixelConverter::PixelConverter(PP_ImageDataFormat format)
+: format_(format),
+  same_order_kernel_(CopyRowSIMD),
+  swapped_order_kernel_(SwapRowSIMD) {}
+
+void PixelConverter::ConvertRow(const uint8_t* src, SourceOrder order,
+    uint32_t* dst, int32_t count) const {
+  if (count <= 0)
+    return;
+  // BGRA keeps B, G, R in memory order, RGBA keeps R, G, B.
+  bool same_order = (format_ == PP_IMAGEDATAFORMAT_BGRA_PREMUL) ==
+    (order == kSourceBGR);
+  if (same_order)
+    same_order_kernel_(src, dst, count);
+  else
+    swapped_order_kernel_(src, dst, count);
+}
+
+uint32_t PixelConverter::MakeColor(uint8_t r, uint8_t g, uint8_t b) const {
+  if (format_ == PP_IMAGEDATAFORMAT_BGRA_PREMUL)
+    return kOpaque | (r << 16) | (g << 8) | b;
+  return kOpaque | (b << 16) | (g << 8) | r;
+}
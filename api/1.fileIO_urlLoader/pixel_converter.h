@@ -0,0 +1,55 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PIXEL_CONVERTER_H_
+#define PIXEL_CONVERTER_H_
+
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/c/ppb_image_data.h"
+
+// PixelConverter turns rows of packed 24-bit pixels into opaque 32-bit pixels
+// in the byte order of a pp::ImageData.  The row kernels are picked once,
+// when the converter is created for a format, instead of once per pixel.
+//
+// The fastest kernel the module was compiled for is used: AVX2 or SSE2 on
+// x86, NEON on ARM, and plain C everywhere else (including PNaCl).
+//
+// EXAMPLE USAGE:
+// PixelConverter converter(pp::ImageData::GetNativeImageDataFormat());
+// converter.ConvertRow(bmp_row, PixelConverter::kSourceBGR,
+//                      image_row, width);
+//
+class PixelConverter {
+  public:
+    // Byte order of the 24-bit source pixels.
+    enum SourceOrder {
+      kSourceRGB,
+      kSourceBGR
+    };
+
+    // Creates a converter for PP_IMAGEDATAFORMAT_BGRA_PREMUL.
+    PixelConverter();
+    explicit PixelConverter(PP_ImageDataFormat format);
+
+    PP_ImageDataFormat format() const { return format_; }
+
+    // Converts |count| pixels from |src| (3 bytes each, in |order|) into
+    // |dst|.  The alpha channel is set to 255.
+    void ConvertRow(const uint8_t* src, SourceOrder order,
+        uint32_t* dst, int32_t count) const;
+
+    // Packs a single pixel.  Handy for overlays; use ConvertRow() for images.
+    uint32_t MakeColor(uint8_t r, uint8_t g, uint8_t b) const;
+
+  private:
+    typedef void (*RowKernel)(const uint8_t* src, uint32_t* dst, int32_t count);
+
+    PP_ImageDataFormat format_;
+    // Used when the source already has the destination's byte order.
+    RowKernel same_order_kernel_;
+    // Used when red and blue have to trade places.
+    RowKernel swapped_order_kernel_;
+};
+
+#endif  // PIXEL_CONVERTER_H_
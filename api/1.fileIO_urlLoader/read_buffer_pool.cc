@@ -0,0 +1,66 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "read_buffer_pool.h"
+
+namespace {
+  // Free buffers kept per size; the module runs few downloads at once (see
+  // DownloadManager), so more would only hold memory.
+  const size_t kMaxFreePerSize = 4;
+}
+
+const int32_t ReadBufferPool::kMinSize;
+const int32_t ReadBufferPool::kMaxSize;
+
+// static
+ReadBufferPool* ReadBufferPool::Get() {
+  // Lives as long as the module.
+  static ReadBufferPool* pool = new ReadBufferPool;
+  return pool;
+}
+
+ReadBufferPool::ReadBufferPool() : free_(SizeClass(kMaxSize) + 1) {}
+
+ReadBufferPool::~ReadBufferPool() {
+  for (size_t i = 0; i < free_.size(); ++i) {
+    for (size_t j = 0; j < free_[i].size(); ++j)
+      delete[] free_[i][j];
+  }
+}
+
+// static
+int32_t ReadBufferPool::SizeFor(int64_t bytes) {
+  int32_t size = kMinSize;
+  while (size < kMaxSize && size < bytes)
+    size *= 2;
+  return size;
+}
+
+// static
+int ReadBufferPool::SizeClass(int32_t size) {
+  int size_class = 0;
+  for (int32_t class_size = kMinSize; class_size < size; class_size *= 2)
+    size_class++;
+  return size_class;
+}
+
+char* ReadBufferPool::Acquire(int32_t size) {
+  std::vector<char*>& free = free_[SizeClass(size)];
+  if (free.empty())
+    return new char[size];
+  char* buffer = free.back();
+  free.pop_back();
+  return buffer;
+}
+
+void ReadBufferPool::Release(char* buffer, int32_t size) {
+  if (!buffer)
+    return;
+  std::vector<char*>& free = free_[SizeClass(size)];
+  if (free.size() >= kMaxFreePerSize) {
+    delete[] buffer;
+    return;
+  }
+  free.push_back(buffer);
+}
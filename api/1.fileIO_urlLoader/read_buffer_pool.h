@@ -0,0 +1,54 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef READ_BUFFER_POOL_H_
+#define READ_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+
+// ReadBufferPool keeps the buffers that downloads read their response bodies
+// into, so that a stream of downloads does not allocate and free one per
+// transfer.  Buffers come in power-of-two sizes from kMinSize to kMaxSize;
+// a few of each size are kept once returned.
+//
+// There is one pool for the module, used on the main thread only, where all
+// URL loads run.
+//
+// EXAMPLE USAGE:
+// int32_t size = ReadBufferPool::SizeFor(wanted);
+// char* buffer = ReadBufferPool::Get()->Acquire(size);
+// ...
+// ReadBufferPool::Get()->Release(buffer, size);
+//
+class ReadBufferPool {
+  public:
+    static const int32_t kMinSize = 16 * 1024;
+    static const int32_t kMaxSize = 1024 * 1024;
+
+    static ReadBufferPool* Get();
+
+    // The pool size that holds |bytes|, within kMinSize and kMaxSize.
+    static int32_t SizeFor(int64_t bytes);
+
+    // Returns a buffer of |size| bytes, which must come from SizeFor().
+    char* Acquire(int32_t size);
+    // Gives back a buffer returned by Acquire(|size|).
+    void Release(char* buffer, int32_t size);
+
+  private:
+    ReadBufferPool();
+    ~ReadBufferPool();
+
+    static int SizeClass(int32_t size);
+
+    // Free buffers, one list per power of two from kMinSize on.
+    std::vector<std::vector<char*> > free_;
+
+    ReadBufferPool(const ReadBufferPool&);
+    void operator=(const ReadBufferPool&);
+};
+
+#endif  // READ_BUFFER_POOL_H_
@@ -0,0 +1,342 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+
+#include "segmented_download.h"
+
+namespace {
+  // The first request asks for this much; small files need no other.
+  const int64_t kFirstSegmentBytes = 256 * 1024;
+  // Segments are not made smaller than this, whatever the file size.
+  const int64_t kMinSegmentBytes = 256 * 1024;
+  // Requests running at once for one download.  The DownloadManager counts
+  // the download as one job, so keep this well below the browser's limit.
+  const int kMaxSegments = 3;
+  // Times a segment is asked for again after a failure.
+  const int kMaxRetries = 3;
+  // Times a download starts over because the file changed on the server.
+  const int kMaxRestarts = 1;
+
+  // What If-Range can carry for |validators|: weak entity tags are not
+  // allowed, and without a strong one only the date is left.  "" if there
+  // is nothing to tell a version by.
+  std::string IfRangeValidator(
+      const DownloadFileWriter::Validators& validators) {
+    if (!validators.etag.empty() && validators.etag.compare(0, 2, "W/") != 0)
+      return validators.etag;
+    return validators.last_modified;
+  }
+}
+
+// A range of the file and the request fetching it.  Forwards what its
+// URLLoaderHandler reports to the download.
+class SegmentedDownload::Segment : public URLLoaderHandler::Listener {
+  public:
+    Segment(SegmentedDownload* download, int64_t begin, int64_t end,
+        bool first)
+    : download_(download),
+      begin_(begin),
+      end_(end),
+      received_(0),
+      retries_(0),
+      first_(first),
+      not_modified_(false),
+      changed_(false),
+      handler_(NULL) {}
+
+    int64_t begin() const { return begin_; }
+    // -1 if the segment goes on to the end of the file.
+    int64_t end() const { return end_; }
+    int64_t received() const { return received_; }
+    int retries() const { return retries_; }
+    // True until the first response of the download is in.
+    bool first() const { return first_; }
+    // The request was conditional and the saved file is still current.
+    bool not_modified() const { return not_modified_; }
+    // The file no longer matches the If-Range of the request.
+    bool changed() const { return changed_; }
+    URLLoaderHandler* handler() const { return handler_; }
+
+    void set_end(int64_t end) { end_ = end; }
+    void set_handler(URLLoaderHandler* handler) { handler_ = handler; }
+
+    // True if the request ended before the whole range arrived.
+    bool IsShort() const {
+      return end_ >= 0 && begin_ + received_ < end_;
+    }
+
+    // Asks for what is left of the range next time.
+    void PrepareRetry() {
+      begin_ += received_;
+      received_ = 0;
+      retries_++;
+    }
+
+    virtual void OnDownloadStart(const std::string& /* file_name */,
+        int64_t total_bytes) {
+      if (first_) {
+        first_ = false;
+        download_->OnFirstResponse(this, total_bytes);
+      }
+    }
+
+    virtual void OnDownloadData(const std::string& /* file_name */,
+        int64_t offset, const char* data, int32_t size) {
+      received_ += size;
+      download_->OnSegmentData(offset, data, size);
+    }
+
+    virtual void OnDownloadCached(const std::string& /* file_name */) {}
+
+    virtual bool IsBehind(const std::string& /* file_name */) {
+      return download_->listener_->IsBehind(download_->file_name_);
+    }
+
+    virtual void OnDownloadEnd(const std::string& /* file_name */,
+        const std::string& /* url */, bool success, std::string* /* body */) {
+      // The handler deletes itself after this call.
+      not_modified_ = handler_->is_not_modified();
+      changed_ = handler_->resource_changed();
+      handler_ = NULL;
+      download_->OnSegmentEnd(this, success);
+    }
+
+  private:
+    SegmentedDownload* download_;  // Weak pointer.
+    int64_t begin_;
+    int64_t end_;
+    int64_t received_;
+    int retries_;
+    bool first_;
+    bool not_modified_;
+    bool changed_;
+    URLLoaderHandler* handler_;    // Weak pointer, NULL between requests.
+
+    Segment(const Segment&);
+    void operator=(const Segment&);
+};
+
+SegmentedDownload::SegmentedDownload(pp::Instance* instance,
+    const std::string& url, const std::string& file_name,
+    DownloadFileWriter* writer, URLLoaderHandler::Listener* listener)
+: instance_(instance),
+  url_(url),
+  file_name_(file_name),
+  writer_(writer),
+  listener_(listener),
+  cc_factory_(this),
+  total_bytes_(-1),
+  resumable_(false),
+  changed_(false),
+  restarts_(0),
+  failed_(false) {
+  writer_->AddRef();
+}
+
+SegmentedDownload::~SegmentedDownload() {
+  for (size_t i = 0; i < queued_.size(); ++i)
+    delete queued_[i];
+  writer_->Release();
+}
+
+void SegmentedDownload::Start() {
+  writer_->LoadJournal(url_, &journal_,
+      cc_factory_.NewCallback(&SegmentedDownload::OnJournalLoaded));
+}
+
+void SegmentedDownload::Abort() {
+  for (size_t i = 0; i < active_.size(); ++i) {
+    active_[i]->handler()->Abort();
+    delete active_[i];
+  }
+  delete this;
+}
+
+void SegmentedDownload::OnJournalLoaded(int32_t /* result */) {
+  if (journal_.total > 0 && IfRangeValidator(journal_.validators).empty()) {
+    // Nothing tells whether the file is still the one the journal is of.
+    StartOver();
+  } else if (journal_.total > 0) {
+    // An earlier attempt got this far; fetch only what it missed, if the
+    // file has not changed since.
+    total_bytes_ = journal_.total;
+    resumable_ = true;
+    validators_ = journal_.validators;
+    if_range_ = IfRangeValidator(validators_);
+    writer_->StartJournal(url_, total_bytes_, validators_);
+    listener_->OnDownloadStart(file_name_, total_bytes_);
+    listener_->OnDownloadResumed(file_name_, journal_.written.size());
+    QueueSegments(journal_.written.Missing(total_bytes_));
+    StartSegments();
+  } else {
+    // A fresh download; ask for it only if the saved file is out of date.
+    writer_->LoadValidators(url_, &validators_,
+        cc_factory_.NewCallback(&SegmentedDownload::OnValidatorsLoaded));
+  }
+}
+
+void SegmentedDownload::OnValidatorsLoaded(int32_t /* result */) {
+  queued_.push_back(new Segment(this, 0, kFirstSegmentBytes, true));
+  StartSegments();
+}
+
+void SegmentedDownload::StartOver() {
+  for (size_t i = 0; i < queued_.size(); ++i)
+    delete queued_[i];
+  queued_.clear();
+  total_bytes_ = -1;
+  resumable_ = false;
+  if_range_.clear();
+  // The saved file is being replaced; there is nothing to revalidate.
+  validators_ = DownloadFileWriter::Validators();
+  writer_->Restart();
+  queued_.push_back(new Segment(this, 0, kFirstSegmentBytes, true));
+  StartSegments();
+}
+
+void SegmentedDownload::QueueSegments(
+    const std::vector<ByteRangeSet::Range>& missing) {
+  int64_t missing_bytes = 0;
+  for (size_t i = 0; i < missing.size(); ++i)
+    missing_bytes += missing[i].end - missing[i].begin;
+  const int64_t segment_bytes = std::max(kMinSegmentBytes,
+      (missing_bytes + kMaxSegments - 1) / kMaxSegments);
+  for (size_t i = 0; i < missing.size(); ++i) {
+    for (int64_t begin = missing[i].begin; begin < missing[i].end;
+        begin += segment_bytes) {
+      int64_t end = std::min(begin + segment_bytes, missing[i].end);
+      queued_.push_back(new Segment(this, begin, end, false));
+    }
+  }
+}
+
+void SegmentedDownload::StartSegments() {
+  while (!failed_ && !changed_ &&
+      static_cast<int>(active_.size()) < kMaxSegments && !queued_.empty()) {
+    Segment* segment = queued_.front();
+    queued_.pop_front();
+    if (!StartRequest(segment)) {
+      delete segment;
+      failed_ = true;
+    }
+  }
+  if (active_.empty() && changed_ && !failed_) {
+    changed_ = false;
+    StartOver();
+    return;
+  }
+  if (active_.empty() && (failed_ || queued_.empty())) {
+    // Report once everything is on disk.
+    writer_->Finish(cc_factory_.NewCallback(&SegmentedDownload::OnFileWritten));
+  }
+}
+
+bool SegmentedDownload::StartRequest(Segment* segment) {
+  URLLoaderHandler* handler = URLLoaderHandler::Create(
+      instance_, url_, file_name_, segment);
+  if (!handler)
+    return false;
+  if (segment->begin() > 0 || segment->end() >= 0) {
+    handler->set_range(segment->begin(), segment->end() < 0 ? -1 :
+        segment->end() - segment->begin());
+  }
+  if (!segment->first() && !if_range_.empty())
+    handler->set_if_range(if_range_);
+  if (segment->first()) {
+    if (!validators_.etag.empty())
+      handler->AddRequestHeader("If-None-Match", validators_.etag);
+    if (!validators_.last_modified.empty())
+      handler->AddRequestHeader("If-Modified-Since", validators_.last_modified);
+  }
+  handler->set_file_writer(writer_);
+  segment->set_handler(handler);
+  active_.push_back(segment);
+  handler->Start();
+  return true;
+}
+
+void SegmentedDownload::OnFirstResponse(Segment* segment,
+    int64_t total_bytes) {
+  total_bytes_ = total_bytes;
+  // Kept with the file once it is complete, for the next download.
+  validators_.etag = segment->handler()->GetResponseHeader("ETag");
+  validators_.last_modified =
+    segment->handler()->GetResponseHeader("Last-Modified");
+  if (segment->handler()->is_partial() && total_bytes > 0) {
+    // The server honours ranges: journal the download and fetch the rest
+    // in parallel.
+    resumable_ = true;
+    if_range_ = IfRangeValidator(validators_);
+    writer_->StartJournal(url_, total_bytes, validators_);
+    segment->set_end(std::min(segment->end(), total_bytes));
+    std::vector<ByteRangeSet::Range> rest;
+    if (segment->end() < total_bytes) {
+      ByteRangeSet::Range range = { segment->end(), total_bytes };
+      rest.push_back(range);
+    }
+    QueueSegments(rest);
+  } else if (segment->handler()->is_partial()) {
+    // Part of a file of unknown size; there is no telling what is missing.
+    failed_ = true;
+  } else {
+    // The whole file comes in this one response.
+    segment->set_end(-1);
+  }
+  listener_->OnDownloadStart(file_name_, total_bytes_);
+  StartSegments();
+}
+
+void SegmentedDownload::OnSegmentData(int64_t offset, const char* data,
+    int32_t size) {
+  listener_->OnDownloadData(file_name_, offset, data, size);
+}
+
+void SegmentedDownload::OnSegmentEnd(Segment* segment, bool success) {
+  active_.erase(std::find(active_.begin(), active_.end(), segment));
+  if (success && segment->not_modified()) {
+    // Only the first request can be conditional, and nothing else runs.
+    delete segment;
+    listener_->OnDownloadCached(file_name_);
+    ReportEndAndDie(true);
+    return;
+  }
+  if (!success && segment->changed()) {
+    // Bytes of two versions must not end up in one file.
+    delete segment;
+    if (!changed_ && restarts_ < kMaxRestarts) {
+      restarts_++;
+      changed_ = true;
+    } else if (!changed_) {
+      failed_ = true;
+    }
+  } else if (!success || segment->IsShort()) {
+    // Without ranges only a request that got nothing can be made again.
+    if (!failed_ && segment->retries() < kMaxRetries &&
+        (resumable_ || segment->received() == 0)) {
+      segment->PrepareRetry();
+      queued_.push_front(segment);
+    } else {
+      delete segment;
+      failed_ = true;
+    }
+  } else {
+    delete segment;
+  }
+  StartSegments();
+}
+
+void SegmentedDownload::OnFileWritten(int32_t result) {
+  const bool success = result == PP_OK && !failed_;
+  if (success && !validators_.empty())
+    writer_->SaveValidators(url_, validators_);
+  ReportEndAndDie(success);
+}
+
+void SegmentedDownload::ReportEndAndDie(bool success) {
+  // After a failure what was written stays in the journal, for the next
+  // attempt to resume.
+  listener_->OnDownloadEnd(file_name_, url_, success, NULL);
+  delete this;
+}
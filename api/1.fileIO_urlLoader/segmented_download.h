@@ -0,0 +1,112 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SEGMENTED_DOWNLOAD_H_
+#define SEGMENTED_DOWNLOAD_H_
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/instance.h"
+#include "ppapi/utility/completion_callback_factory.h"
+
+#include "byte_range_set.h"
+#include "download_file_writer.h"
+#include "url_loader_handler.h"
+
+// SegmentedDownload fetches a URL into a file with HTTP Range requests, a few
+// segments at a time, and resumes where an interrupted download stopped.
+//
+// It first reads the writer's journal.  If an earlier attempt left one, only
+// the missing ranges are fetched, and the Listener is told with
+// OnDownloadResumed() how much of the file it will not see.  Otherwise a
+// first request asks for the beginning of the file: a 206 answer tells the
+// size of the whole file and the rest is split into segments fetched in
+// parallel; a server that ignores the range sends the whole file in that one
+// answer.  A segment that fails is asked for again from the last byte
+// received, a few times.
+//
+// Every segment after the first carries the ETag (or Last-Modified) of the
+// version being fetched as If-Range, and the journal keeps it for the next
+// attempt.  If the file has changed on the server, what was fetched is
+// dropped and the download starts over once; the Listener then sees a
+// second OnDownloadStart().
+//
+// The ETag and Last-Modified of a complete download are saved with the
+// file.  The first request of the next download of the URL carries them as
+// If-None-Match and If-Modified-Since; on a 304 answer nothing is fetched
+// and the Listener gets OnDownloadCached() instead of the data.
+//
+// The bytes are reported to the Listener at their offset, so they may come
+// out of order.  The Listener sees one OnDownloadStart() and one
+// OnDownloadEnd() (with no body) for the whole download.  Self-destroys once
+// it has reported the end.  Main thread only.
+//
+// EXAMPLE USAGE:
+// SegmentedDownload* download = new SegmentedDownload(instance,
+//     "http://host/big.bmp", "/big.bmp", writer, listener);
+// download->Start();
+//
+class SegmentedDownload {
+  public:
+    // Takes a reference to |writer|, which must not be used by anyone else.
+    SegmentedDownload(pp::Instance* instance, const std::string& url,
+        const std::string& file_name, DownloadFileWriter* writer,
+        URLLoaderHandler::Listener* listener);
+
+    void Start();
+
+    // Stops the download without reporting anything, for a listener that
+    // is going away, and deletes it.  The requests under way are aborted.
+    // No work of the writer may be left that it is waiting for.
+    void Abort();
+
+  private:
+    class Segment;
+    friend class Segment;
+
+    ~SegmentedDownload();
+
+    void OnJournalLoaded(int32_t result);
+    void OnValidatorsLoaded(int32_t result);
+    // Drops what was fetched and asks for the file from the beginning.
+    void StartOver();
+    // Splits |missing| into segments and queues them.
+    void QueueSegments(const std::vector<ByteRangeSet::Range>& missing);
+    // Starts queued segments while there is room, and finishes the file
+    // once none is left.
+    void StartSegments();
+    bool StartRequest(Segment* segment);
+    void OnFirstResponse(Segment* segment, int64_t total_bytes);
+    void OnSegmentData(int64_t offset, const char* data, int32_t size);
+    void OnSegmentEnd(Segment* segment, bool success);
+    void OnFileWritten(int32_t result);
+    void ReportEndAndDie(bool success);
+
+    pp::Instance* instance_;                 // Weak pointer.
+    std::string url_;
+    std::string file_name_;
+    DownloadFileWriter* writer_;
+    URLLoaderHandler::Listener* listener_;   // Weak pointer.
+    pp::CompletionCallbackFactory<SegmentedDownload> cc_factory_;
+
+    DownloadFileWriter::Journal journal_;
+    // Those of the saved file, then those of the response.
+    DownloadFileWriter::Validators validators_;
+    int64_t total_bytes_;  // Size of the whole file, or -1 if not known yet.
+    bool resumable_;       // The server honours ranges; a journal is kept.
+    // Sent as If-Range by the requests for the rest of the file, or "".
+    std::string if_range_;
+    bool changed_;         // Start over once no request is running.
+    int restarts_;
+    std::deque<Segment*> queued_;
+    std::vector<Segment*> active_;  // Those with a request running.
+    bool failed_;
+
+    SegmentedDownload(const SegmentedDownload&);
+    void operator=(const SegmentedDownload&);
+};
+
+#endif  // SEGMENTED_DOWNLOAD_H_
@@ -0,0 +1,206 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdlib.h>
+#include <sstream>
+
+#include "series_prefetcher.h"
+
+namespace {
+  // Steps in one direction before the next images are fetched: two, so a
+  // single jump from one image to its neighbour does not start anything.
+  const int kStepsToPredict = 2;
+  // Images fetched ahead of the last one asked for.
+  const int kLookAhead = 3;
+  // File bytes fetched ahead and not asked for yet.
+  const int64_t kDefaultBudgetBytes = 16 * 1024 * 1024;
+  // A prefetch of unknown size is counted as this much until it is in.
+  const int64_t kUnknownSizeBytes = 1024 * 1024;
+}
+
+SeriesPrefetcher::SeriesPrefetcher(Client* client)
+: client_(client),
+  budget_bytes_(kDefaultBudgetBytes),
+  has_last_(false),
+  direction_(0),
+  steps_(0),
+  ready_bytes_(0) {}
+
+// static
+bool SeriesPrefetcher::Parse(const std::string& name, SeriesName* series) {
+  // Only the last path component counts: "2012/img7.bmp" is image 7.
+  size_t slash = name.find_last_of('/');
+  size_t start = slash == std::string::npos ? 0 : slash + 1;
+  size_t end = name.find_last_of("0123456789");
+  if (end == std::string::npos || end < start)
+    return false;
+  size_t begin = name.find_last_not_of("0123456789", end);
+  begin = (begin == std::string::npos || begin < start) ? start : begin + 1;
+  // Numbers this long are ids or dates, not positions in a series.
+  if (end + 1 - begin > 9)
+    return false;
+  series->prefix = name.substr(0, begin);
+  series->number = strtoll(name.c_str() + begin, NULL, 10);
+  series->digits = end + 1 - begin;
+  series->suffix = name.substr(end + 1);
+  return true;
+}
+
+// static
+std::string SeriesPrefetcher::Format(const SeriesName& series,
+    int64_t number) {
+  std::stringstream ss;
+  ss << number;
+  std::string digits = ss.str();
+  if (digits.size() < series.digits)
+    digits.insert(0, series.digits - digits.size(), '0');
+  return series.prefix + digits + series.suffix;
+}
+
+bool SeriesPrefetcher::OnRequest(const std::string& url,
+    const std::string& file_name) {
+  seen_urls_.insert(url);
+  // The user has it now; it no longer counts against the budget.
+  std::map<std::string, int64_t>::iterator ready = ready_.find(file_name);
+  if (ready != ready_.end()) {
+    ready_bytes_ -= ready->second;
+    ready_.erase(ready);
+  }
+  bool needs_download = true;
+  PrefetchMap::iterator running = running_.find(file_name);
+  if (running != running_.end()) {
+    if (client_->CancelPrefetch(file_name)) {
+      // Fetched for the user instead, at their priority.
+      running_.erase(running);
+    } else {
+      // Halfway there; a second download of the file would only race it.
+      running->second.wanted = true;
+      needs_download = false;
+    }
+  }
+
+  SeriesName url_series;
+  SeriesName file_series;
+  if (!Parse(url, &url_series) || !Parse(file_name, &file_series)) {
+    // Not part of a series; whatever was predicted is not wanted.
+    CancelPending();
+    has_last_ = false;
+    direction_ = 0;
+    steps_ = 0;
+    ReleaseReady();
+    return needs_download;
+  }
+
+  int step = 0;
+  if (has_last_ && url_series.prefix == last_url_.prefix &&
+      url_series.suffix == last_url_.suffix &&
+      file_series.prefix == last_file_.prefix &&
+      file_series.suffix == last_file_.suffix) {
+    int64_t delta = url_series.number - last_url_.number;
+    if (delta == 1 || delta == -1)
+      step = static_cast<int>(delta);
+  }
+  if (step != 0 && step == direction_) {
+    steps_++;
+  } else {
+    // A new series or a turn: start counting again.
+    CancelPending();
+    direction_ = step;
+    steps_ = step != 0 ? 1 : 0;
+  }
+  has_last_ = true;
+  last_url_ = url_series;
+  last_file_ = file_series;
+  ReleaseReady();
+
+  if (direction_ != 0 && steps_ >= kStepsToPredict)
+    PrefetchAfter(url_series.number);
+  return needs_download;
+}
+
+bool SeriesPrefetcher::IsPrefetch(const std::string& file_name) const {
+  return running_.count(file_name) > 0;
+}
+
+void SeriesPrefetcher::OnPrefetchStart(const std::string& file_name,
+    int64_t total_bytes) {
+  PrefetchMap::iterator it = running_.find(file_name);
+  if (it != running_.end() && total_bytes >= 0)
+    it->second.bytes = total_bytes;
+}
+
+bool SeriesPrefetcher::OnPrefetchEnd(const std::string& file_name,
+    bool success) {
+  PrefetchMap::iterator it = running_.find(file_name);
+  if (it == running_.end())
+    return false;
+  const bool wanted = it->second.wanted;
+  if (success && !wanted) {
+    ready_bytes_ += it->second.bytes;
+    ready_[file_name] = it->second.bytes;
+  }
+  running_.erase(it);
+  // Room may have been left by a failure or a smaller file than expected.
+  if (direction_ != 0 && steps_ >= kStepsToPredict)
+    PrefetchAfter(last_url_.number);
+  return wanted;
+}
+
+void SeriesPrefetcher::PrefetchAfter(int64_t number) {
+  int64_t committed = ready_bytes_;
+  for (PrefetchMap::const_iterator it = running_.begin();
+      it != running_.end(); ++it)
+    committed += it->second.bytes;
+
+  for (int i = 1; i <= kLookAhead; ++i) {
+    int64_t next = number + i * direction_;
+    if (next < 0)
+      break;
+    if (committed >= budget_bytes_)
+      break;
+    std::string url = Format(last_url_, next);
+    if (seen_urls_.count(url))
+      continue;
+    std::string file_name = Format(last_file_, next);
+    seen_urls_.insert(url);
+    Prefetch& prefetch = running_[file_name];
+    prefetch.url = url;
+    prefetch.bytes = kUnknownSizeBytes;
+    prefetch.wanted = false;
+    committed += kUnknownSizeBytes;
+    client_->StartPrefetch(url, file_name);
+  }
+}
+
+void SeriesPrefetcher::CancelPending() {
+  PrefetchMap::iterator it = running_.begin();
+  while (it != running_.end()) {
+    if (it->second.wanted) {
+      ++it;
+    } else if (client_->CancelPrefetch(it->first)) {
+      // Never fetched; it may be predicted again later.
+      seen_urls_.erase(it->second.url);
+      running_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void SeriesPrefetcher::ReleaseReady() {
+  std::set<std::string> ahead;
+  if (has_last_ && direction_ != 0) {
+    for (int i = 1; i <= kLookAhead; ++i)
+      ahead.insert(Format(last_file_, last_file_.number + i * direction_));
+  }
+  std::map<std::string, int64_t>::iterator it = ready_.begin();
+  while (it != ready_.end()) {
+    if (ahead.count(it->first)) {
+      ++it;
+    } else {
+      ready_bytes_ -= it->second;
+      ready_.erase(it++);
+    }
+  }
+}
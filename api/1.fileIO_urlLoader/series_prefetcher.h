@@ -0,0 +1,116 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SERIES_PREFETCHER_H_
+#define SERIES_PREFETCHER_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include "ppapi/c/pp_stdint.h"
+
+// SeriesPrefetcher watches the images the user asks for and, once they step
+// through a numbered series ("1.bmp", "2.bmp", ...) in one direction, asks
+// its Client to fetch the next few in the background.  A step the other way
+// or out of the series cancels the prefetches that have not started.
+//
+// Prefetching stops while the files fetched ahead and not asked for yet
+// take more than budget_bytes().  A file stops counting once it is asked
+// for, or once the user is no longer heading for it: after a turn, a step
+// out of the series, or a step past it.  All methods must be called on the
+// main thread.
+//
+// EXAMPLE USAGE:
+// SeriesPrefetcher prefetcher(client);
+// prefetcher.OnRequest("http://host/3.bmp", "/3.bmp");  // After 1 and 2:
+// // client->StartPrefetch("http://host/4.bmp", "/4.bmp"), then 5 and 6.
+//
+class SeriesPrefetcher {
+  public:
+    class Client {
+      public:
+        // Starts downloading |url| into |file_name| at low priority.  The
+        // download must be reported back with OnPrefetchStart() and
+        // OnPrefetchEnd().
+        virtual void StartPrefetch(const std::string& url,
+            const std::string& file_name) = 0;
+        // Drops the prefetch of |file_name| if it has not started yet.
+        // Returns false if it is already running.
+        virtual bool CancelPrefetch(const std::string& file_name) = 0;
+
+      protected:
+        virtual ~Client() {}
+    };
+
+    explicit SeriesPrefetcher(Client* client);
+
+    void set_budget_bytes(int64_t bytes) { budget_bytes_ = bytes; }
+    int64_t budget_bytes() const { return budget_bytes_; }
+
+    // The user asked for |url| to be saved as |file_name|.  Returns false
+    // if a prefetch of it is already running and will do: OnPrefetchEnd()
+    // then tells that the user is waiting for it.
+    bool OnRequest(const std::string& url, const std::string& file_name);
+
+    // True if |file_name| is being prefetched, not fetched for the user.
+    bool IsPrefetch(const std::string& file_name) const;
+
+    // Reports of the downloads started by StartPrefetch().  |total_bytes|
+    // is -1 if the size is not known.
+    // OnPrefetchEnd() returns true if the user asked for the file while it
+    // was prefetched.
+    void OnPrefetchStart(const std::string& file_name, int64_t total_bytes);
+    bool OnPrefetchEnd(const std::string& file_name, bool success);
+
+  private:
+    // A name split around its last number: "img/" 7 ".bmp".  |digits| is
+    // the width of the number, to keep leading zeros.
+    struct SeriesName {
+      std::string prefix;
+      int64_t number;
+      size_t digits;
+      std::string suffix;
+    };
+
+    static bool Parse(const std::string& name, SeriesName* series);
+    static std::string Format(const SeriesName& series, int64_t number);
+
+    // Prefetches up to kLookAhead images past |number|.
+    void PrefetchAfter(int64_t number);
+    // Cancels the prefetches that have not started.
+    void CancelPending();
+    // Stops counting the files fetched ahead, except those among the next
+    // kLookAhead images in the direction of travel.  They stay saved.
+    void ReleaseReady();
+
+    Client* client_;  // Weak pointer.
+    int64_t budget_bytes_;
+
+    // The last request and the series it belongs to.
+    bool has_last_;
+    SeriesName last_url_;
+    SeriesName last_file_;
+    int direction_;  // +1 or -1 once the user steps, else 0.
+    int steps_;      // Steps made in |direction_| in a row.
+
+    struct Prefetch {
+      std::string url;
+      int64_t bytes;  // Guessed until the download starts.
+      bool wanted;    // The user asked for it meanwhile.
+    };
+    typedef std::map<std::string, Prefetch> PrefetchMap;
+
+    // Prefetches asked of the client and not ended, by file name.
+    PrefetchMap running_;
+    // Prefetched files the user has not asked for yet, with their size.
+    std::map<std::string, int64_t> ready_;
+    int64_t ready_bytes_;
+    // URLs asked for or prefetched; they are not prefetched again.
+    std::set<std::string> seen_urls_;
+
+    SeriesPrefetcher(const SeriesPrefetcher&);
+    void operator=(const SeriesPrefetcher&);
+};
+
+#endif  // SERIES_PREFETCHER_H_
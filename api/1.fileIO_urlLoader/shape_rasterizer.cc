@@ -0,0 +1,314 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <math.h>
+#include <algorithm>
+
+#include "shape_rasterizer.h"
+
+namespace {
+  // Pixel x covers [x, x + 1); its centre is at x + 0.5.
+  const float kHalfPixel = 0.5f;
+
+  inline bool IsEmpty(float begin, float end) {
+    return !(begin <= end);
+  }
+
+  // Narrows [*begin, *end] to the x where |slope| * x + |offset| lies in
+  // [low, high].
+  void ClipLinear(float slope, float offset, float low, float high,
+      float* begin, float* end) {
+    if (slope == 0.0f) {
+      if (offset < low || offset > high)
+        *end = *begin - 1.0f;
+      return;
+    }
+    float a = (low - offset) / slope;
+    float b = (high - offset) / slope;
+    if (a > b)
+      std::swap(a, b);
+    *begin = std::max(*begin, a);
+    *end = std::min(*end, b);
+  }
+}
+
+// Distance from a point to the centre line of a stroke.
+class ShapeRasterizer::Stroke {
+  public:
+    virtual float Distance(float x, float y) const = 0;
+
+  protected:
+    virtual ~Stroke() {}
+};
+
+// A segment with round caps: every point within some radius of it.
+class ShapeRasterizer::SegmentStroke : public ShapeRasterizer::Stroke {
+  public:
+    SegmentStroke(float x0, float y0, float x1, float y1)
+    : x0_(x0), y0_(y0), dx_(x1 - x0), dy_(y1 - y0),
+      length_squared_(dx_ * dx_ + dy_ * dy_) {}
+
+    virtual float Distance(float x, float y) const {
+      float px = x - x0_;
+      float py = y - y0_;
+      float t = 0.0f;
+      if (length_squared_ > 0.0f)
+        t = std::min(1.0f, std::max(0.0f,
+              (px * dx_ + py * dy_) / length_squared_));
+      px -= t * dx_;
+      py -= t * dy_;
+      return sqrtf(px * px + py * py);
+    }
+
+    // Row |y| of the points within |radius| of the segment.  The shape is
+    // convex, so this is the hull of its parts: the band along the segment
+    // and the discs around both ends.
+    Interval Row(float y, float radius) const {
+      Interval row = { 1.0f, 0.0f };
+      if (radius < 0.0f)
+        return row;
+      AddDisc(x0_, y0_, y, radius, &row);
+      AddDisc(x0_ + dx_, y0_ + dy_, y, radius, &row);
+      if (length_squared_ > 0.0f) {
+        // Along the segment: 0 <= (p - p0).d <= |d|^2.  Across it:
+        // |(p - p0).n| <= radius * |d|, n being d turned by 90 degrees.
+        float begin = -1e30f;
+        float end = 1e30f;
+        float py = y - y0_;
+        ClipLinear(dx_, py * dy_ - x0_ * dx_, 0.0f, length_squared_,
+            &begin, &end);
+        float reach = radius * sqrtf(length_squared_);
+        ClipLinear(-dy_, py * dx_ + x0_ * dy_, -reach, reach, &begin, &end);
+        Include(begin, end, &row);
+      }
+      return row;
+    }
+
+  private:
+    static void AddDisc(float cx, float cy, float y, float radius,
+        Interval* row) {
+      float h = radius * radius - (y - cy) * (y - cy);
+      if (h < 0.0f)
+        return;
+      float w = sqrtf(h);
+      Include(cx - w, cx + w, row);
+    }
+
+    static void Include(float begin, float end, Interval* row) {
+      if (IsEmpty(begin, end))
+        return;
+      if (IsEmpty(row->begin, row->end)) {
+        row->begin = begin;
+        row->end = end;
+      } else {
+        row->begin = std::min(row->begin, begin);
+        row->end = std::max(row->end, end);
+      }
+    }
+
+    float x0_;
+    float y0_;
+    float dx_;
+    float dy_;
+    float length_squared_;
+};
+
+// The outline of an axis-aligned ellipse.  Offset curves of an ellipse are
+// not ellipses; growing or shrinking both radii by the offset is close
+// enough for strokes a few pixels wide.
+class ShapeRasterizer::EllipseStroke : public ShapeRasterizer::Stroke {
+  public:
+    EllipseStroke(float cx, float cy, float rx, float ry)
+    : cx_(cx), cy_(cy), rx_(rx), ry_(ry) {}
+
+    // Distance estimated as f / |grad f| for f = (x/rx)^2 + (y/ry)^2 - 1.
+    virtual float Distance(float x, float y) const {
+      float px = x - cx_;
+      float py = y - cy_;
+      float fx = px / (rx_ * rx_);
+      float fy = py / (ry_ * ry_);
+      float gradient = 2.0f * sqrtf(fx * fx + fy * fy);
+      float f = px * fx + py * fy - 1.0f;
+      if (gradient == 0.0f)
+        return std::min(rx_, ry_);
+      return fabsf(f) / gradient;
+    }
+
+    // Half of the width of row |y| inside the ellipse grown by |offset|,
+    // or a negative value if the row misses it.
+    float HalfWidth(float y, float offset) const {
+      float rx = rx_ + offset;
+      float ry = ry_ + offset;
+      if (rx <= 0.0f || ry <= 0.0f)
+        return -1.0f;
+      float t = (y - cy_) / ry;
+      if (t * t > 1.0f)
+        return -1.0f;
+      return rx * sqrtf(1.0f - t * t);
+    }
+
+    float cx() const { return cx_; }
+    float cy() const { return cy_; }
+    float rx() const { return rx_; }
+    float ry() const { return ry_; }
+
+  private:
+    float cx_;
+    float cy_;
+    float rx_;
+    float ry_;
+};
+
+ShapeRasterizer::ShapeRasterizer(OverlayLayer* layer, const pp::Rect& clip)
+: layer_(layer),
+  clip_(clip),
+  color_(0xFF000000u),
+  half_thickness_(0.5f) {}
+
+void ShapeRasterizer::set_thickness(float thickness) {
+  half_thickness_ = std::max(thickness, 0.0f) / 2;
+}
+
+void ShapeRasterizer::DrawLine(const pp::Point& from, const pp::Point& to) {
+  SegmentStroke segment(from.x() + kHalfPixel, from.y() + kHalfPixel,
+      to.x() + kHalfPixel, to.y() + kHalfPixel);
+  // Pixels within half_thickness_ - 0.5 of the line are fully covered; the
+  // coverage falls to zero half_thickness_ + 0.5 away from it.
+  float outer_radius = half_thickness_ + kHalfPixel;
+  float solid_radius = half_thickness_ - kHalfPixel;
+  int32_t top = static_cast<int32_t>(
+      floorf(std::min(from.y(), to.y()) + kHalfPixel - outer_radius));
+  int32_t bottom = static_cast<int32_t>(
+      ceilf(std::max(from.y(), to.y()) + kHalfPixel + outer_radius));
+  top = std::max(top, clip_.y());
+  bottom = std::min(bottom, clip_.bottom());
+  for (int32_t y = top; y < bottom; ++y) {
+    float center = y + kHalfPixel;
+    Interval outer = segment.Row(center, outer_radius);
+    Interval solid = segment.Row(center, solid_radius);
+    EmitRow(y, outer, &solid, 1, segment);
+  }
+}
+
+void ShapeRasterizer::DrawPolyline(const std::vector<pp::Point>& points,
+    bool closed) {
+  if (points.size() == 1)
+    DrawLine(points[0], points[0]);
+  for (size_t i = 1; i < points.size(); ++i)
+    DrawLine(points[i - 1], points[i]);
+  if (closed && points.size() > 2)
+    DrawLine(points.back(), points.front());
+}
+
+void ShapeRasterizer::DrawRect(const pp::Rect& rect) {
+  if (rect.IsEmpty())
+    return;
+  std::vector<pp::Point> corners;
+  corners.push_back(pp::Point(rect.x(), rect.y()));
+  corners.push_back(pp::Point(rect.right() - 1, rect.y()));
+  corners.push_back(pp::Point(rect.right() - 1, rect.bottom() - 1));
+  corners.push_back(pp::Point(rect.x(), rect.bottom() - 1));
+  DrawPolyline(corners, true);
+}
+
+void ShapeRasterizer::DrawEllipse(const pp::Rect& rect) {
+  if (rect.IsEmpty())
+    return;
+  // Like DrawRect(), the stroke runs through the centre of the border
+  // pixels of |rect|.
+  float rx = (rect.width() - 1) / 2.0f;
+  float ry = (rect.height() - 1) / 2.0f;
+  if (rx <= 0.0f || ry <= 0.0f) {
+    DrawLine(rect.point(), pp::Point(rect.right() - 1, rect.bottom() - 1));
+    return;
+  }
+  EllipseStroke ellipse(rect.x() + rect.width() / 2.0f,
+      rect.y() + rect.height() / 2.0f, rx, ry);
+
+  float outer = half_thickness_ + kHalfPixel;
+  float solid = half_thickness_ - kHalfPixel;
+  int32_t top = static_cast<int32_t>(floorf(ellipse.cy() - ry - outer));
+  int32_t bottom = static_cast<int32_t>(ceilf(ellipse.cy() + ry + outer));
+  top = std::max(top, clip_.y());
+  bottom = std::min(bottom, clip_.bottom());
+  const float cx = ellipse.cx();
+  for (int32_t y = top; y < bottom; ++y) {
+    float center = y + kHalfPixel;
+    float outer_width = ellipse.HalfWidth(center, outer);
+    if (outer_width < 0.0f)
+      continue;
+    float hole_width = ellipse.HalfWidth(center, -outer);
+    float solid_outer = solid >= 0.0f ? ellipse.HalfWidth(center, solid) : -1.0f;
+    float solid_inner = ellipse.HalfWidth(center, -solid);
+
+    // Fully covered: between the two solid curves, on either side.
+    Interval solids[2];
+    int solid_count = 0;
+    if (solid_outer >= 0.0f) {
+      float inner = std::max(solid_inner, 0.0f);
+      Interval left = { cx - solid_outer, cx - inner };
+      Interval right = { cx + inner, cx + solid_outer };
+      solids[solid_count++] = left;
+      solids[solid_count++] = right;
+    }
+
+    if (hole_width < 0.0f) {
+      Interval row = { cx - outer_width, cx + outer_width };
+      EmitRow(y, row, solids, solid_count, ellipse);
+    } else {
+      // The row crosses the hole: draw both sides and skip the inside.
+      Interval left = { cx - outer_width, cx - hole_width };
+      Interval right = { cx + hole_width, cx + outer_width };
+      EmitRow(y, left, solids, solid_count, ellipse);
+      EmitRow(y, right, solids, solid_count, ellipse);
+    }
+  }
+}
+
+void ShapeRasterizer::EmitRow(int32_t y, const Interval& outer,
+    const Interval* solid, int solid_count, const Stroke& stroke) {
+  if (IsEmpty(outer.begin, outer.end))
+    return;
+  // First and last pixels whose centre is inside |outer|.
+  int32_t begin = static_cast<int32_t>(ceilf(outer.begin - kHalfPixel));
+  int32_t end = static_cast<int32_t>(floorf(outer.end - kHalfPixel)) + 1;
+  begin = std::max(begin, clip_.x());
+  end = std::min(end, clip_.right());
+
+  const float center_y = y + kHalfPixel;
+  int32_t x = begin;
+  while (x < end) {
+    // Jump over fully covered runs in one span.
+    int32_t solid_end = x;
+    for (int i = 0; i < solid_count; ++i) {
+      const Interval& run = solid[i];
+      if (IsEmpty(run.begin, run.end))
+        continue;
+      int32_t run_begin = static_cast<int32_t>(ceilf(run.begin - kHalfPixel));
+      int32_t run_end = static_cast<int32_t>(floorf(run.end - kHalfPixel)) + 1;
+      if (run_begin <= x && x < run_end)
+        solid_end = std::max(solid_end, std::min(run_end, end));
+    }
+    if (solid_end > x) {
+      EmitSpan(x, y, solid_end - x, 255);
+      x = solid_end;
+      continue;
+    }
+
+    float coverage = half_thickness_ + kHalfPixel -
+      stroke.Distance(x + kHalfPixel, center_y);
+    coverage = std::min(1.0f, coverage);
+    if (coverage > 0.0f)
+      EmitSpan(x, y, 1, static_cast<uint8_t>(coverage * 255.0f + 0.5f));
+    ++x;
+  }
+}
+
+void ShapeRasterizer::EmitSpan(int32_t x, int32_t y, int32_t width,
+    uint8_t coverage) {
+  if (coverage == 0)
+    return;
+  layer_->AddSpan(x, y, width, color_, coverage);
+  bounds_ = bounds_.Union(pp::Rect(x, y, width, 1));
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SHAPE_RASTERIZER_H_
+#define SHAPE_RASTERIZER_H_
+
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+#include "ppapi/cpp/point.h"
+#include "ppapi/cpp/rect.h"
+
+#include "overlay_layer.h"
+
+// ShapeRasterizer strokes antialiased annotations into an OverlayLayer.
+//
+// Shapes are drawn a row at a time: the part of a row the stroke covers is
+// solved for directly, the fully covered pixels are emitted as one opaque
+// span and only the pixels on the antialiased edge get a coverage of their
+// own.  The cost of a shape is therefore proportional to the number of rows
+// it spans plus the length of its edges, however large its bounding box is.
+//
+// Points are pixel coordinates; a stroke runs through the centre of the
+// pixels it joins.
+//
+// EXAMPLE USAGE:
+// ShapeRasterizer shapes(&overlay, pp::Rect(canvas_size));
+// shapes.set_color(converter.MakeColor(255, 255, 0));
+// shapes.set_thickness(2);
+// shapes.DrawLine(first_click, second_click);
+// Invalidate(shapes.bounds());
+//
+class ShapeRasterizer {
+  public:
+    // Nothing is drawn outside of |clip|.
+    ShapeRasterizer(OverlayLayer* layer, const pp::Rect& clip);
+
+    // |color| is a native pixel, see PixelConverter::MakeColor().
+    void set_color(uint32_t color) { color_ = color; }
+    // Width of the stroke in pixels; the default is 1.
+    void set_thickness(float thickness);
+
+    // Bounding box of every pixel drawn so far.
+    const pp::Rect& bounds() const { return bounds_; }
+
+    void DrawLine(const pp::Point& from, const pp::Point& to);
+
+    // Joins |points| in order, and the last one back to the first if
+    // |closed| is set.
+    void DrawPolyline(const std::vector<pp::Point>& points, bool closed);
+
+    // Outlines the pixels on the border of |rect|.
+    void DrawRect(const pp::Rect& rect);
+
+    // Outlines the ellipse inscribed in |rect|.
+    void DrawEllipse(const pp::Rect& rect);
+
+  private:
+    // The part of a row covered by a shape, in continuous coordinates.
+    struct Interval {
+      float begin;
+      float end;
+    };
+
+    class Stroke;
+    class SegmentStroke;
+    class EllipseStroke;
+
+    // Emits the pixels of row |y| whose centres lie in |outer|.  Those in
+    // one of the |solid_count| |solid| intervals are fully covered, the
+    // others get their coverage from |stroke|.
+    void EmitRow(int32_t y, const Interval& outer,
+        const Interval* solid, int solid_count, const Stroke& stroke);
+    void EmitSpan(int32_t x, int32_t y, int32_t width, uint8_t coverage);
+
+    OverlayLayer* layer_;  // Weak pointer.
+    pp::Rect clip_;
+    uint32_t color_;
+    float half_thickness_;
+    pp::Rect bounds_;
+};
+
+#endif  // SHAPE_RASTERIZER_H_
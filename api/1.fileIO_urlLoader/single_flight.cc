@@ -0,0 +1,73 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ppapi/c/pp_errors.h"
+
+#include "single_flight.h"
+
+SingleFlight::SingleFlight() {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+SingleFlight::~SingleFlight() {
+  pthread_mutex_destroy(&lock_);
+}
+
+bool SingleFlight::Begin(const std::string& key, Waiter* waiter,
+    int32_t request_id) {
+  pthread_mutex_lock(&lock_);
+  FlightMap::iterator found = flights_.find(key);
+  if (found == flights_.end()) {
+    flights_[key].runner = waiter;
+    pthread_mutex_unlock(&lock_);
+    return true;
+  }
+  Request request = { waiter, request_id };
+  found->second.joined.push_back(request);
+  pthread_mutex_unlock(&lock_);
+  return false;
+}
+
+void SingleFlight::End(const std::string& key, Waiter* runner,
+    int32_t result) {
+  pthread_mutex_lock(&lock_);
+  FlightMap::iterator found = flights_.find(key);
+  if (found != flights_.end() && found->second.runner == runner) {
+    Notify(key, found->second, result);
+    flights_.erase(found);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+void SingleFlight::RemoveWaiter(Waiter* waiter) {
+  pthread_mutex_lock(&lock_);
+  FlightMap::iterator it = flights_.begin();
+  while (it != flights_.end()) {
+    std::vector<Request>& joined = it->second.joined;
+    size_t kept = 0;
+    for (size_t i = 0; i < joined.size(); ++i) {
+      if (joined[i].waiter != waiter)
+        joined[kept++] = joined[i];
+    }
+    joined.resize(kept);
+    if (it->second.runner == waiter) {
+      // Nobody is left to end it.
+      Notify(it->first, it->second, PP_ERROR_ABORTED);
+      flights_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+// static
+void SingleFlight::Notify(const std::string& key, const Flight& flight,
+    int32_t result) {
+  for (size_t i = 0; i < flight.joined.size(); ++i) {
+    const Request& request = flight.joined[i];
+    request.waiter->OnFlightDone(key, request.request_id, result,
+        request.waiter == flight.runner);
+  }
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SINGLE_FLIGHT_H_
+#define SINGLE_FLIGHT_H_
+
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "ppapi/c/pp_stdint.h"
+
+// SingleFlight lets concurrent requests for the same operation share one run
+// of it.  The first request for a key runs the operation; requests for the
+// key made before it ends, by the same instance or another one, join the run
+// and are all told its result.  It is owned by the module and shared by all
+// instances, from any thread.
+//
+// Keys are opaque to it: "load\n/dir" or "getUrl\n<url>\n<file>", say.
+//
+// EXAMPLE USAGE:
+// if (flights->Begin(key, this, request_id)) {
+//   int32_t result = DoIt();
+//   flights->End(key, this, result);  // Calls OnFlightDone() of the others.
+// }
+//
+class SingleFlight {
+  public:
+    class Waiter {
+      public:
+        // The run of |key| that request |request_id| joined has ended with
+        // |result|; |own_run| is true if this waiter ran it.  Called on the
+        // thread that ended the run with the lock of the SingleFlight held,
+        // so it must not call back into it, and must not block.
+        virtual void OnFlightDone(const std::string& key, int32_t request_id,
+            int32_t result, bool own_run) = 0;
+
+      protected:
+        virtual ~Waiter() {}
+    };
+
+    SingleFlight();
+    ~SingleFlight();
+
+    // Returns true if no run of |key| is under way: |waiter| is to run it
+    // and then call End().  Otherwise request |request_id| of |waiter| joins
+    // that run and false is returned.
+    bool Begin(const std::string& key, Waiter* waiter, int32_t request_id);
+
+    // Ends the run of |key| that |runner| started, telling every request
+    // that joined it |result|.  Does nothing if |runner| has no such run.
+    void End(const std::string& key, Waiter* runner, int32_t result);
+
+    // Forgets the requests of |waiter|, which is going away, and ends the
+    // runs it started with PP_ERROR_ABORTED.  No call reaches it afterwards.
+    void RemoveWaiter(Waiter* waiter);
+
+  private:
+    struct Request {
+      Waiter* waiter;
+      int32_t request_id;
+    };
+    struct Flight {
+      Waiter* runner;
+      std::vector<Request> joined;
+    };
+    typedef std::map<std::string, Flight> FlightMap;
+
+    // Tells the requests of |flight| its |result|.  Called with lock_ held.
+    static void Notify(const std::string& key, const Flight& flight,
+        int32_t result);
+
+    FlightMap flights_;
+    pthread_mutex_t lock_;
+
+    SingleFlight(const SingleFlight&);
+    void operator=(const SingleFlight&);
+};
+
+#endif  // SINGLE_FLIGHT_H_
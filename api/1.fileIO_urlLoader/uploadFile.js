@@ -13,11 +13,14 @@ function handleFileSelect(evt) {
     reader.onload = (function(f) {
       return function(e) {
         if (common.naclModule) {
+          // The ArrayBuffer is posted as is: [UPLOAD, kind, name, data].
           var arrayBuffer = e.target.result;
-          var uint8Array = new Uint8Array(arrayBuffer);
-          var array = Array.prototype.slice.call(uint8Array);
           common.logMessage("SENT");
-          common.naclModule.postMessage(array);
+          common.naclModule.postMessage(['UPLOAD', 'image', f.name, arrayBuffer]);
+          if (document.getElementById('saveUploads').checked) {
+            common.naclModule.postMessage(
+                ['UPLOAD', 'save', '/' + f.name, arrayBuffer]);
+          }
         }
       };
     })(f);
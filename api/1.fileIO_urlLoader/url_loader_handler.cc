@@ -2,17 +2,55 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <algorithm>
+#include <sstream>
 #include "ppapi/c/pp_errors.h"
 #include "ppapi/c/ppb_instance.h"
+#include "ppapi/cpp/core.h"
 #include "ppapi/cpp/module.h"
+#include "ppapi/cpp/url_response_info.h"
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_array.h"
 
+#include "download_file_writer.h"
+#include "read_buffer_pool.h"
 #include "url_loader_handler.h"
 
+namespace {
+  // Reads stop while this many of a handler's chunks wait for the file
+  // writer.
+  const int32_t kMaxPendingChunks = 4;
+  // How long to wait before asking a listener that is behind again.
+  const int32_t kListenerRetryMs = 20;
+
+  // Read buffer size before anything is known of the response.
+  const int32_t kDefaultBufferSize = 32 * 1024;
+  // The first buffer is not made larger than this, whatever the size of
+  // the body; a fast transfer grows it soon enough.
+  const int32_t kMaxInitialBufferSize = 64 * 1024;
+  // Reads in a row that fill the buffer before it doubles, and that use
+  // less than a quarter of it before it halves.
+  const int32_t kFullReadsToGrow = 4;
+  const int32_t kShortReadsToShrink = 8;
+
+  std::string ToLower(std::string text) {
+    for (size_t i = 0; i < text.size(); ++i)
+      text[i] = tolower(static_cast<unsigned char>(text[i]));
+    return text;
+  }
+
+  // Size of the whole resource from "Content-Range: bytes 0-99/1234", or -1.
+  int64_t ParseContentRangeTotal(const std::string& value) {
+    size_t slash = value.rfind('/');
+    if (slash == std::string::npos || value.compare(slash + 1, 1, "*") == 0)
+      return -1;
+    return strtoll(value.c_str() + slash + 1, NULL, 10);
+  }
+}
+
 #ifdef WIN32
 #undef min
 #undef max
@@ -24,19 +62,38 @@
 
 URLLoaderHandler* URLLoaderHandler::Create(pp::Instance* instance,
     const std::string& url,
-    const std::string& fname) {
-  return new URLLoaderHandler(instance, url, fname);
+    const std::string& fname,
+    Listener* listener) {
+  return new URLLoaderHandler(instance, url, fname, listener);
 }
 
 URLLoaderHandler::URLLoaderHandler(pp::Instance* instance,
     const std::string& url,
-    const std::string& fname)
+    const std::string& fname,
+    Listener* listener)
 : instance_(instance),
+  listener_(listener),
   url_(url),
   url_request_(instance),
   url_loader_(instance),
-  buffer_(new char[READ_BUFFER_SIZE]),
+  buffer_(NULL),
+  buffer_size_(0),
+  wanted_buffer_size_(kDefaultBufferSize),
+  full_reads_(0),
+  short_reads_(0),
+  expected_bytes_(-1),
   file_name_(fname),
+  file_writer_(NULL),
+  range_offset_(0),
+  range_length_(-1),
+  body_offset_(0),
+  resource_changed_(false),
+  status_code_(0),
+  pending_chunks_(0),
+  read_paused_(false),
+  resume_timer_pending_(false),
+  loader_busy_(false),
+  aborted_(false),
   cc_factory_(this) {
     url_request_.SetURL(url);
     url_request_.SetMethod("GET");
@@ -45,24 +102,117 @@ URLLoaderHandler::URLLoaderHandler(pp::Instance* instance,
   }
 
 URLLoaderHandler::~URLLoaderHandler() {
-  delete[] buffer_;
-  buffer_ = NULL;
+  ReleaseBuffer();
+  if (file_writer_)
+    file_writer_->Release();
+}
+
+void URLLoaderHandler::set_file_writer(DownloadFileWriter* writer) {
+  if (writer)
+    writer->AddRef();
+  if (file_writer_)
+    file_writer_->Release();
+  file_writer_ = writer;
+}
+
+void URLLoaderHandler::set_range(int64_t offset, int64_t length) {
+  range_offset_ = offset;
+  range_length_ = length;
+  body_offset_ = offset;
+  std::stringstream ss;
+  ss << "bytes=" << offset << '-';
+  if (length >= 0)
+    ss << offset + length - 1;
+  AddRequestHeader("Range", ss.str());
+}
+
+void URLLoaderHandler::set_if_range(const std::string& validator) {
+  if_range_ = validator;
+  AddRequestHeader("If-Range", validator);
+}
+
+void URLLoaderHandler::AddRequestHeader(const std::string& name,
+    const std::string& value) {
+  // SetHeaders() replaces them all; they are "\n" separated.
+  if (!request_headers_.empty())
+    request_headers_ += "\n";
+  request_headers_ += name + ": " + value;
+  url_request_.SetHeaders(request_headers_);
+}
+
+std::string URLLoaderHandler::GetResponseHeader(const std::string& name) const {
+  // Headers come as "Name: value" lines.
+  const std::string wanted = ToLower(name);
+  std::stringstream ss(response_headers_);
+  std::string line;
+  while (std::getline(ss, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos || ToLower(line.substr(0, colon)) != wanted)
+      continue;
+    size_t begin = line.find_first_not_of(" \t", colon + 1);
+    size_t end = line.find_last_not_of(" \t\r");
+    if (begin == std::string::npos)
+      return std::string();
+    return line.substr(begin, end - begin + 1);
+  }
+  return std::string();
 }
 
 void URLLoaderHandler::Start() {
   pp::CompletionCallback cc =
     cc_factory_.NewCallback(&URLLoaderHandler::OnOpen);
+  loader_busy_ = true;
   url_loader_.Open(url_request_, cc);
 }
 
+void URLLoaderHandler::Abort() {
+  aborted_ = true;
+  listener_ = NULL;
+  instance_ = NULL;
+  set_file_writer(NULL);
+  url_loader_.Close();
+  // A pending Open() or read still completes, into OnOpen() or OnRead().
+  // The other callbacks are cancelled when the handler goes.
+  if (!loader_busy_)
+    delete this;
+}
+
 void URLLoaderHandler::OnOpen(int32_t result) {
+  loader_busy_ = false;
+  if (aborted_) {
+    delete this;
+    return;
+  }
   if (result != PP_OK) {
     ReportResultAndDie(url_, "pp::URLLoader::Open() failed", false);
     return;
   }
-  // Here you would process the headers. A real program would want to at least
-  // check the HTTP code and potentially cancel the request.
-  // pp::URLResponseInfo response = loader_.GetResponseInfo();
+  pp::URLResponseInfo response = url_loader_.GetResponseInfo();
+  status_code_ = response.GetStatusCode();
+  pp::Var headers = response.GetHeaders();
+  if (headers.is_string())
+    response_headers_ = headers.AsString();
+  if (is_not_modified()) {
+    // Nothing follows; the copy the request was made for is still good.
+    ReportResultAndDie(url_, url_response_body_, true);
+    return;
+  }
+  // Relative URLs of packaged apps may report no status at all.
+  if (status_code_ != 0 && (status_code_ < 200 || status_code_ >= 300)) {
+    ReportResultAndDie(url_, "HTTP request failed", false);
+    return;
+  }
+  if (!if_range_.empty() && !MatchesIfRange()) {
+    // The bytes would not fit with those fetched before.
+    resource_changed_ = true;
+    ReportResultAndDie(url_, "Resource changed", false);
+    return;
+  }
+  if (range_offset_ > 0 && !is_partial()) {
+    // The whole resource is coming instead of the range asked for.
+    ReportResultAndDie(url_, "Server does not support ranges", false);
+    return;
+  }
 
   // Try to figure out how many bytes of data are going to be downloaded in
   // order to allocate memory for the response body in advance (this will
@@ -74,10 +224,21 @@ void URLLoaderHandler::OnOpen(int32_t result) {
   int64_t total_bytes_to_be_received = 0;
   if (url_loader_.GetDownloadProgress(&bytes_received,
         &total_bytes_to_be_received)) {
-    if (total_bytes_to_be_received > 0) {
+    if (total_bytes_to_be_received > 0 && !file_writer_) {
       url_response_body_.reserve(total_bytes_to_be_received);
     }
   }
+  if (total_bytes_to_be_received > 0) {
+    // A small body fits in one read.
+    expected_bytes_ = total_bytes_to_be_received;
+    wanted_buffer_size_ = ReadBufferPool::SizeFor(
+        std::min<int64_t>(expected_bytes_, kMaxInitialBufferSize));
+  }
+  int64_t total_bytes = total_bytes_to_be_received > 0 ? total_bytes_to_be_received : -1;
+  if (is_partial())
+    total_bytes = ParseContentRangeTotal(GetResponseHeader("Content-Range"));
+  if (listener_)
+    listener_->OnDownloadStart(file_name_, total_bytes);
   // We will not use the download progress anymore, so just disable it.
   url_request_.SetRecordDownloadProgress(false);
 
@@ -89,25 +250,105 @@ void URLLoaderHandler::AppendDataBytes(const char* buffer, int32_t num_bytes) {
   if (num_bytes <= 0)
     return;
   // Make sure we don't get a buffer overrun.
-  num_bytes = std::min(READ_BUFFER_SIZE, num_bytes);
-  // Note that we do *not* try to minimally increase the amount of allocated
-  // memory here by calling url_response_body_.reserve().  Doing so causes a
-  // lot of string reallocations that kills performance for large files.
-  url_response_body_.insert(
-      url_response_body_.end(), buffer, buffer + num_bytes);
+  num_bytes = std::min(buffer_size_, num_bytes);
+  if (file_writer_) {
+    pending_chunks_++;
+    file_writer_->Write(body_offset_, buffer, num_bytes,
+        cc_factory_.NewCallback(&URLLoaderHandler::OnChunkWritten));
+  } else {
+    // Note that we do *not* try to minimally increase the amount of allocated
+    // memory here by calling url_response_body_.reserve().  Doing so causes a
+    // lot of string reallocations that kills performance for large files.
+    url_response_body_.insert(
+        url_response_body_.end(), buffer, buffer + num_bytes);
+  }
+  if (listener_)
+    listener_->OnDownloadData(file_name_, body_offset_, buffer, num_bytes);
+  body_offset_ += num_bytes;
+}
+
+bool URLLoaderHandler::WriterIsBehind() const {
+  return file_writer_ && pending_chunks_ >= kMaxPendingChunks;
+}
+
+bool URLLoaderHandler::ShouldPause() const {
+  return WriterIsBehind() || (listener_ && listener_->IsBehind(file_name_));
+}
+
+void URLLoaderHandler::PauseRead() {
+  read_paused_ = true;
+  // OnChunkWritten() reads on once the writer has caught up.  The listener
+  // cannot call back, so it is asked again a little later.
+  if (!WriterIsBehind() && !resume_timer_pending_) {
+    resume_timer_pending_ = true;
+    pp::Module::Get()->core()->CallOnMainThread(kListenerRetryMs,
+        cc_factory_.NewCallback(&URLLoaderHandler::OnResumeTimer));
+  }
+}
+
+void URLLoaderHandler::ResumeRead() {
+  if (!read_paused_)
+    return;
+  if (ShouldPause()) {
+    PauseRead();
+    return;
+  }
+  read_paused_ = false;
+  ReadBody();
+}
+
+void URLLoaderHandler::OnResumeTimer(int32_t /* result */) {
+  resume_timer_pending_ = false;
+  if (aborted_)
+    return;
+  ResumeRead();
+}
+
+void URLLoaderHandler::OnChunkWritten(int32_t result) {
+  pending_chunks_--;
+  if (aborted_)
+    return;
+  if (result != PP_OK) {
+    ReportResultAndDie(url_, "Writing the download failed", false);
+    return;
+  }
+  ResumeRead();
+}
+
+void URLLoaderHandler::OnFileWritten(int32_t result) {
+  if (aborted_)
+    return;
+  if (result != PP_OK) {
+    ReportResultAndDie(url_, "Writing the download failed", false);
+    return;
+  }
+  ReportResultAndDie(url_, url_response_body_, true);
 }
 
 void URLLoaderHandler::OnRead(int32_t result) {
+  loader_busy_ = false;
+  if (aborted_) {
+    delete this;
+    return;
+  }
   if (result == PP_OK) {
-    // Streaming the file is complete, delete the read buffer since it is
+    // Streaming the file is complete, give the read buffer back since it is
     // no longer needed.
-    delete[] buffer_;
-    buffer_ = NULL;
+    ReleaseBuffer();
+    if (file_writer_) {
+      // Report once everything is on disk.
+      file_writer_->Finish(cc_factory_.NewCallback(&URLLoaderHandler::OnFileWritten));
+      return;
+    }
     ReportResultAndDie(url_, url_response_body_, true);
+  } else if (result == PP_OK_COMPLETIONPENDING) {
+    // ReadBody() stopped for the file writer or the listener to catch up;
+    // ResumeRead() reads on.
   } else if (result > 0) {
     // The URLLoader just filled "result" number of bytes into our buffer.
     // Save them and perform another read.
     AppendDataBytes(buffer_, result);
+    AdaptBufferSize(result);
     ReadBody();
   } else {
     // A read error occurred.
@@ -117,6 +358,10 @@ void URLLoaderHandler::OnRead(int32_t result) {
 }
 
 void URLLoaderHandler::ReadBody() {
+  if (ShouldPause()) {
+    PauseRead();
+    return;
+  }
   // Note that you specifically want an "optional" callback here. This will
   // allow ReadBody() to return synchronously, ignoring your completion
   // callback, if data is available. For fast connections and large files,
@@ -127,13 +372,25 @@ void URLLoaderHandler::ReadBody() {
     cc_factory_.NewOptionalCallback(&URLLoaderHandler::OnRead);
   int32_t result = PP_OK;
   do {
-    result = url_loader_.ReadResponseBody(buffer_, READ_BUFFER_SIZE, cc);
+    PrepareBuffer();
+    result = url_loader_.ReadResponseBody(buffer_, buffer_size_, cc);
+    if (result == PP_OK_COMPLETIONPENDING)
+      loader_busy_ = true;
     // Handle streaming data directly. Note that we *don't* want to call
     // OnRead here, since in the case of result > 0 it will schedule
     // another call to this function. If the network is very fast, we could
     // end up with a deeply recursive stack.
     if (result > 0) {
       AppendDataBytes(buffer_, result);
+      AdaptBufferSize(result);
+      if (ShouldPause()) {
+        // Let the writer or the listener catch up.  The callback still has
+        // to run once; OnRead() ignores this result.
+        PauseRead();
+        result = PP_OK_COMPLETIONPENDING;
+        cc.Run(result);
+        return;
+      }
     }
   } while (result > 0);
 
@@ -147,6 +404,53 @@ void URLLoaderHandler::ReadBody() {
   }
 }
 
+void URLLoaderHandler::PrepareBuffer() {
+  if (buffer_ && buffer_size_ == wanted_buffer_size_)
+    return;
+  ReleaseBuffer();
+  buffer_size_ = wanted_buffer_size_;
+  buffer_ = ReadBufferPool::Get()->Acquire(buffer_size_);
+}
+
+void URLLoaderHandler::ReleaseBuffer() {
+  ReadBufferPool::Get()->Release(buffer_, buffer_size_);
+  buffer_ = NULL;
+}
+
+void URLLoaderHandler::AdaptBufferSize(int32_t num_bytes) {
+  if (num_bytes >= buffer_size_) {
+    short_reads_ = 0;
+    // No point in a buffer larger than what is left to come.
+    int64_t remaining = expected_bytes_ < 0 ? ReadBufferPool::kMaxSize :
+      expected_bytes_ - (body_offset_ - range_offset_);
+    if (++full_reads_ >= kFullReadsToGrow && buffer_size_ < remaining) {
+      wanted_buffer_size_ = ReadBufferPool::SizeFor(2 * buffer_size_);
+      full_reads_ = 0;
+    }
+  } else if (num_bytes < buffer_size_ / 4) {
+    full_reads_ = 0;
+    if (++short_reads_ >= kShortReadsToShrink) {
+      wanted_buffer_size_ = ReadBufferPool::SizeFor(buffer_size_ / 2);
+      short_reads_ = 0;
+    }
+  } else {
+    full_reads_ = 0;
+    short_reads_ = 0;
+  }
+}
+
+bool URLLoaderHandler::MatchesIfRange() const {
+  // A 200 is the server's way of saying the validator no longer matches.
+  if (!is_partial())
+    return false;
+  // Entity tags are quoted; anything else is a date.  A server that leaves
+  // the header out of the 206 has checked If-Range itself.
+  const bool is_etag = if_range_[0] == '"';
+  const std::string value =
+    GetResponseHeader(is_etag ? "ETag" : "Last-Modified");
+  return value.empty() || value == if_range_;
+}
+
 void URLLoaderHandler::ReportResultAndDie(const std::string& fname,
     const std::string& text,
     bool success) {
@@ -162,20 +466,17 @@ void URLLoaderHandler::ReportResult(const std::string& fname,
   else
     printf("URLLoaderHandler::ReportResult(Err). %s\n", text.c_str());
   fflush(stdout);
-  if (instance_) {
+  if (listener_) {
+    // Handed over in-process; the body is not copied.
+    listener_->OnDownloadEnd(file_name_, url_, success,
+        success && !file_writer_ ? &url_response_body_ : NULL);
+  } else if (instance_ && success) {
     // URLLOADER prefix attached to the first index of VarArray
     // to differentiate message for fileIO and for urlLoader.
+    // The page saves the body under the URL, see example.js.
     pp::VarArray message;
-    message.Set(0, "FILEIO");
-    message.Set(1, "save");
-    message.Set(2, file_name_);
-    pp::VarArray bytearray;
-    for (int i = 0 ; i < text.length() ; i ++) {
-      int el = text[i];
-      pp::Var v(el);
-      bytearray.Set(i, v);
-    }
-    message.Set(3, bytearray);
-    instance_->HandleMessage(message);
+    message.Set(0, "URLLOADER");
+    message.Set(1, fname + "\n" + text);
+    instance_->PostMessage(message);
   }
 }
@@ -11,11 +11,13 @@
 #include "ppapi/cpp/url_loader.h"
 #include "ppapi/cpp/url_request_info.h"
 #include "ppapi/utility/completion_callback_factory.h"
-#define READ_BUFFER_SIZE 32768
+
+class DownloadFileWriter;
 
 // URLLoaderHandler is used to download data from |url|. When download is
-// finished or when an error occurs, it posts a message back to the browser
-// with the results encoded in the message as a string and self-destroys.
+// finished or when an error occurs, it hands the results to its Listener (or,
+// without one, posts them back to the browser encoded in the message as a
+// string) and self-destroys.
 //
 // pp::URLLoader.GetDownloadProgress() is used to to allocate the memory
 // required for url_response_body_ before the download starts.  (This is not so
@@ -25,22 +27,124 @@
 // implementation.)  Other performance improvements made as outlined in this
 // bug: http://code.google.com/p/chromium/issues/detail?id=103947
 //
+// Reads go into a buffer from the ReadBufferPool.  Its size starts from the
+// expected body size and follows what the reads return: it grows while they
+// keep filling it (a fast, large transfer) and shrinks while they return
+// little, so a transfer takes few read callbacks without holding memory it
+// does not use.
+//
+// A Listener, if one is given, sees the body while it is downloaded, one
+// read at a time, so it can be used before the transfer is over.  A
+// listener that queues what it sees says so with IsBehind(); reading pauses
+// meanwhile, so its queue stays as bounded as the file writer's.
+//
+// With a DownloadFileWriter the body is not kept in memory at all: every read
+// is queued to the writer and reading pauses while more than a few of this
+// handler's chunks wait to be written, so memory use does not grow with the
+// file size.  Handlers sharing a writer (the segments of one download) each
+// count their own chunks, so one never waits for another's writes.
+//
+// set_range() fetches part of a resource with an HTTP Range header; the
+// bytes are then reported (and written) at their offset in the resource.
+// AddRequestHeader() can make the request conditional; a 304 answer ends the
+// download successfully without a body (and without writing to the file).
+// set_if_range() makes a range request safe to add to bytes fetched before:
+// if the resource has changed since, the download fails before anything is
+// written, and resource_changed() says why.
+//
 // EXAMPLE USAGE:
 // URLLoaderHandler* handler* = URLLoaderHandler::Create(instance,url);
 // handler->Start();
 //
 class URLLoaderHandler {
   public:
+    // Receives the body of a download as it arrives.  All the calls are
+    // made on the main thread; |file_name| is the one given to Create().
+    class Listener {
+      public:
+        // Headers are in.  |total_bytes| is the size of the whole resource
+        // (not just of the range asked for), or -1 if it is not known.
+        virtual void OnDownloadStart(const std::string& file_name,
+            int64_t total_bytes) = 0;
+        // The next |size| bytes of the body, found at |offset| in the
+        // resource.  |data| is only valid during the call.
+        virtual void OnDownloadData(const std::string& file_name,
+            int64_t offset, const char* data, int32_t size) = 0;
+        // No more data will come from |url|.  On success |body| holds the
+        // whole response; the listener may take it over with swap() rather
+        // than copy it.  |body| is NULL on failure, and when the body went
+        // to a DownloadFileWriter (which has then flushed it).
+        virtual void OnDownloadEnd(const std::string& file_name,
+            const std::string& url, bool success, std::string* body) = 0;
+        // Reported by a SegmentedDownload, before OnDownloadEnd(), instead
+        // of the other calls: the file saved by an earlier download is
+        // still current, so nothing was fetched.
+        virtual void OnDownloadCached(const std::string& file_name) = 0;
+        // Reported by a SegmentedDownload, right after OnDownloadStart():
+        // |bytes| of the file were saved by an earlier attempt, so they are
+        // not fetched and OnDownloadData() does not report them.
+        virtual void OnDownloadResumed(const std::string& /* file_name */,
+            int64_t /* bytes */) {}
+        // True while the listener has so much of |file_name| still to
+        // handle that no more should be read.  It is asked again a little
+        // later; there is no call to say it has caught up.
+        virtual bool IsBehind(const std::string& /* file_name */) {
+          return false;
+        }
+
+      protected:
+        virtual ~Listener() {}
+    };
+
     // Creates instance of URLLoaderHandler on the heap.
     // URLLoaderHandler objects shall be created only on the heap (they
-    // self-destroy when all data is in).
+    // self-destroy when all data is in).  |listener| may be NULL.
     static URLLoaderHandler* Create(pp::Instance* instance_,
-        const std::string& url, const std::string& fname);
+        const std::string& url, const std::string& fname,
+        Listener* listener = NULL);
+    // Writes the body into |writer| as it arrives instead of keeping it in
+    // memory.  Takes a reference; must be called before Start().
+    void set_file_writer(DownloadFileWriter* writer);
+
+    // Fetches only |length| bytes from |offset| on (or everything from
+    // |offset| on, if |length| is -1).  Must be called before Start().  A
+    // server that ignores the range fails the download unless |offset| is 0.
+    void set_range(int64_t offset, int64_t length);
+
+    // Sends the range only if the resource still matches |validator|, a
+    // strong ETag or a Last-Modified date, with an If-Range header.  Any
+    // answer but a 206 of that version fails the download.  Must be called
+    // after set_range() and before Start().
+    void set_if_range(const std::string& validator);
+
+    // Sends "|name|: |value|" with the request.  Must be called before
+    // Start().
+    void AddRequestHeader(const std::string& name, const std::string& value);
+
     // Initiates page (URL) download.
     void Start();
 
+    // Stops the download for good, for a listener that is going away: the
+    // listener, the instance and the file writer are no longer used and
+    // nothing is reported.  The handler deletes itself, at once or when
+    // the URLLoader is done with its buffer.
+    void Abort();
+
+    // The response, once OnDownloadStart() has been called.
+    int32_t status_code() const { return status_code_; }
+    // True if the server sent only the range asked for (HTTP 206).
+    bool is_partial() const { return status_code_ == 206; }
+    // True if a conditional request found the copy at hand still current.
+    bool is_not_modified() const { return status_code_ == 304; }
+    // Value of response header |name| (case does not matter), or "".
+    std::string GetResponseHeader(const std::string& name) const;
+    // True if the download failed because the resource no longer matches
+    // the validator given to set_if_range().
+    bool resource_changed() const { return resource_changed_; }
+
   private:
-    URLLoaderHandler(pp::Instance* instance_, const std::string& url, const std::string& fname);
+    URLLoaderHandler(pp::Instance* instance_, const std::string& url,
+        const std::string& fname, Listener* listener);
     ~URLLoaderHandler();
 
     // Callback for the pp::URLLoader::Open().
@@ -59,10 +163,36 @@ class URLLoaderHandler {
     // OnRead() will be called when bytes are received or when an error occurs.
     void ReadBody();
 
-    // Append data bytes read from the URL onto the internal buffer.  Does
-    // nothing if |num_bytes| is 0.
+    // Gets buffer_ from the pool at wanted_buffer_size_, if it is not that
+    // already.  Only called while no read is pending.
+    void PrepareBuffer();
+    // Gives buffer_ back to the pool.
+    void ReleaseBuffer();
+    // Learns from a read of |num_bytes| what size the next buffer should be.
+    void AdaptBufferSize(int32_t num_bytes);
+
+    // Append data bytes read from the URL onto the internal buffer, or queue
+    // them to the file writer.  Does nothing if |num_bytes| is 0.
     void AppendDataBytes(const char* buffer, int32_t num_bytes);
 
+    // True while the file writer has too much data queued to read more.
+    bool WriterIsBehind() const;
+    // True while the file writer or the listener is behind.
+    bool ShouldPause() const;
+    // Stops reading until whoever is behind has caught up.
+    void PauseRead();
+    // Reads on if nobody is behind any more, or waits some more.
+    void ResumeRead();
+    void OnResumeTimer(int32_t result);
+    // Called on the main thread when the file writer is done with a chunk,
+    // and with all of them.
+    void OnChunkWritten(int32_t result);
+    void OnFileWritten(int32_t result);
+
+    // True if the response is the range of the version set_if_range() asked
+    // for.
+    bool MatchesIfRange() const;
+
     // Post a message back to the browser with the download results.
     void ReportResult(const std::string& fname,
         const std::string& text,
@@ -74,12 +204,32 @@ class URLLoaderHandler {
         bool success);
 
     pp::Instance* instance_;  // Weak pointer.
+    Listener* listener_;      // Weak pointer, may be NULL.
     std::string url_;         // URL to be downloaded.
     pp::URLRequestInfo url_request_;
     pp::URLLoader url_loader_;  // URLLoader provides an API to download URLs.
-    char* buffer_;              // Temporary buffer for reads.
+    char* buffer_;              // Temporary buffer for reads, from the pool.
+    int32_t buffer_size_;
+    int32_t wanted_buffer_size_;  // Taken by the next PrepareBuffer().
+    int32_t full_reads_;          // Reads in a row that filled buffer_.
+    int32_t short_reads_;         // Reads in a row that used little of it.
+    int64_t expected_bytes_;      // Size of this response, or -1.
     std::string file_name_;
     std::string url_response_body_;  // Contains accumulated downloaded data.
+    DownloadFileWriter* file_writer_;  // Replaces url_response_body_ if set.
+    int64_t range_offset_;           // First byte asked for.
+    int64_t range_length_;           // Bytes asked for, -1 for all.
+    int64_t body_offset_;            // Offset of the next byte received.
+    std::string request_headers_;
+    std::string if_range_;           // Validator sent as If-Range, or "".
+    bool resource_changed_;
+    int32_t status_code_;
+    std::string response_headers_;
+    int32_t pending_chunks_;         // Queued to file_writer_, not written.
+    bool read_paused_;               // Waiting for someone to catch up.
+    bool resume_timer_pending_;      // OnResumeTimer() will be called.
+    bool loader_busy_;               // An Open() or read of url_loader_ runs.
+    bool aborted_;                   // Abort() was called.
     pp::CompletionCallbackFactory<URLLoaderHandler> cc_factory_;
 
     URLLoaderHandler(const URLLoaderHandler&);
@@ -0,0 +1,48 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include "worker_pool.h"
+
+namespace {
+  const int kMinThreads = 1;
+  const int kMaxThreads = 8;
+}
+
+WorkerPool::WorkerPool(const pp::InstanceHandle& instance, int thread_count)
+: next_thread_(0) {
+  if (thread_count < kMinThreads)
+    thread_count = kMinThreads;
+  for (int i = 0; i < thread_count; i++)
+    threads_.push_back(new pp::SimpleThread(instance));
+}
+
+WorkerPool::~WorkerPool() {
+  for (size_t i = 0; i < threads_.size(); i++) {
+    threads_[i]->Join();
+    delete threads_[i];
+  }
+}
+
+void WorkerPool::Start() {
+  for (size_t i = 0; i < threads_.size(); i++)
+    threads_[i]->Start();
+}
+
+void WorkerPool::PostWork(const pp::CompletionCallback& callback) {
+  // Not locked: calls must not overlap.  The viewer posts only from canvas
+  // work, which its FileWorkQueue runs one at a time and in order.
+  threads_[next_thread_]->message_loop().PostWork(callback);
+  next_thread_ = (next_thread_ + 1) % threads_.size();
+}
+
+int WorkerPool::DefaultThreadCount() {
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  if (processors < kMinThreads)
+    return kMinThreads;
+  if (processors > kMaxThreads)
+    return kMaxThreads;
+  return static_cast<int>(processors);
+}
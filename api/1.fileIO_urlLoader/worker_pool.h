@@ -0,0 +1,51 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <vector>
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/utility/threading/simple_thread.h"
+
+// WorkerPool runs work on a fixed set of pp::SimpleThreads.  Every thread
+// has its own pp::MessageLoop, so work posted to the pool may use blocking
+// PPAPI calls (pp::BlockUntilComplete()) just like work posted to a single
+// file thread.
+//
+// PostWork() hands callbacks to the threads in turn.  To balance uneven jobs,
+// post one callback per job and let each callback take the next job from a
+// shared queue instead of binding a job to a thread up front.
+//
+// EXAMPLE USAGE:
+// WorkerPool pool(instance, WorkerPool::DefaultThreadCount());
+// pool.Start();
+// pool.PostWork(factory.NewCallback(&MyInstance::DoJob));
+//
+class WorkerPool {
+  public:
+    WorkerPool(const pp::InstanceHandle& instance, int thread_count);
+    // Joins all threads.
+    ~WorkerPool();
+
+    void Start();
+    int thread_count() const { return static_cast<int>(threads_.size()); }
+
+    // Posts |callback| to the next thread in turn.  May be called from any
+    // thread, but never from two at once.
+    void PostWork(const pp::CompletionCallback& callback);
+
+    // One thread per online processor, within sensible bounds.
+    static int DefaultThreadCount();
+
+  private:
+    std::vector<pp::SimpleThread*> threads_;
+    size_t next_thread_;
+
+    WorkerPool(const WorkerPool&);
+    void operator=(const WorkerPool&);
+};
+
+#endif  // WORKER_POOL_H_
@@ -50,16 +50,32 @@ function onRadioClicked(e) {
   }
 }
 
+// Id of the next request; every reply to a request carries its id.
+var nextRequestId = 0;
+// Requests not DONE yet: the command of each, by id.
+var pendingRequests = {};
+
 function makeMessage(command, path) {
   // Package a message using a simple protocol containing:
-  // [command, <path>, <extra args>...]
-  var msg = [command, path];
+  // [command, <request id>, <path>, <extra args>...]
+  var requestId = nextRequestId++;
+  pendingRequests[requestId] = command;
+  var msg = [command, requestId, path];
   for (var i = 2; i < arguments.length; ++i) {
     msg.push(arguments[i]);
   }
   return msg;
 }
 
+// Packages many operations, each [command, path, <extra arg>], into one
+// message with a single BATCH reply.  With |stopOnError| set, the
+// operations after a failed one are skipped.
+function makeBatchMessage(operations, stopOnError) {
+  var requestId = nextRequestId++;
+  pendingRequests[requestId] = 'batch';
+  return ['batch', requestId, operations, !!stopOnError];
+}
+
 function saveFile() {
   if (common.naclModule) {
     var fileName = document.querySelector('#saveFile input').value;
@@ -114,8 +130,36 @@ function handleMessage(message_event) {
   var msg = message_event.data;
   var command = msg[0];
   var args = msg.slice(1);
+  // Replies to a request have its id after the command.
+  var requestId = null;
+  if (typeof args[0] == 'number') {
+    requestId = args[0];
+    args = args.slice(1);
+  }
 
-  if (command == 'ERR') {
+  if (command == 'DONE') {
+    // [DONE, id, result]: the last reply to a request, 0 meaning success.
+    var requestCommand = pendingRequests[requestId];
+    delete pendingRequests[requestId];
+    if (args[0] != 0)
+      common.logMessage(requestCommand + ' #' + requestId + ' failed: ' + args[0]);
+  } else if (command == 'CHUNK') {
+    // [CHUNK, id, offset, file size, ArrayBuffer]: part of a 'read', in
+    // file order.  A read always has an id, so the offset is never taken
+    // for it.
+    common.logMessage('Read ' + args[2].byteLength + ' bytes at ' + args[0] +
+        ' of ' + args[1]);
+  } else if (command == 'BATCH') {
+    // One [result] or [result, contents or names] per operation.
+    var results = args[0];
+    var failed = 0;
+    for (var i = 0; i < results.length; ++i) {
+      if (results[i][0] != 0)
+        failed++;
+    }
+    common.logMessage('Batch of ' + results.length + ' operations, ' +
+        failed + ' failed');
+  } else if (command == 'ERR') {
     common.logMessage('Error: ' + args[0]);
   } else if (command == 'STAT') {
     common.logMessage(args[0]);
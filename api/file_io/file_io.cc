@@ -8,6 +8,7 @@
 #define __STDC_LIMIT_MACROS
 #include <stdio.h>
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -19,12 +20,13 @@
 #include "ppapi/cpp/file_ref.h"
 #include "ppapi/cpp/file_system.h"
 #include "ppapi/cpp/instance.h"
-#include "ppapi/cpp/message_loop.h"
 #include "ppapi/cpp/module.h"
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_array_buffer.h"
 #include "ppapi/utility/completion_callback_factory.h"
-#include "ppapi/utility/threading/simple_thread.h"
+
+#include "file_work_queue.h"
 
 #ifndef INT32_MAX
 #define INT32_MAX (0x7FFFFFFF)
@@ -41,6 +43,52 @@
 
 namespace {
 typedef std::vector<std::string> StringVector;
+// File operations that may run at once, so a large save does not hold up a
+// listing.
+const int kFileThreads = 3;
+// Stands for a request the page gave no id.
+const int32_t kNoRequestId = -1;
+// Stands for a request of a batch, which reports nothing on its own: the
+// batch posts all results at once.
+const int32_t kBatchedRequestId = -2;
+// Bytes read and posted at a time by a "read"; bounds what the module holds.
+const int32_t kReadChunkBytes = 1024 * 1024;
+
+// Reads a number sent by the page.  Offsets past 2 GB come as doubles.
+int64_t VarToInt64(const pp::Var& var, int64_t default_value) {
+  if (var.is_int())
+    return var.AsInt();
+  if (var.is_double())
+    return static_cast<int64_t>(var.AsDouble());
+  return default_value;
+}
+
+// Largest single write.  Each FileIO::Write() takes an int32_t size and is
+// copied to the browser in one piece; bounded writes keep that copy small
+// and let files of any size be saved.
+const int32_t kMaxWriteBytes = 4 * 1024 * 1024;
+
+// Writes |size| bytes at |data| into |file| from |offset| on, one bounded
+// write after the other.  A write may take fewer bytes than it was given;
+// the next one goes on from there.  Runs on a thread that may block.
+// Returns PP_OK or the error met.
+int32_t WriteFully(pp::FileIO* file, int64_t offset, const char* data,
+    int64_t size) {
+  int64_t written = 0;
+  while (written < size) {
+    int32_t chunk_size =
+        static_cast<int32_t>(
+            std::min<int64_t>(kMaxWriteBytes, size - written));
+    int32_t bytes_written = file->Write(offset + written, data + written,
+        chunk_size, pp::BlockUntilComplete());
+    if (bytes_written < 0)
+      return bytes_written;
+    if (bytes_written == 0)
+      return PP_ERROR_FAILED;
+    written += bytes_written;
+  }
+  return PP_OK;
+}
 }
 
 /// The Instance class.  One of these exists for each instance of your NaCl
@@ -58,20 +106,19 @@ class FileIoInstance : public pp::Instance {
         callback_factory_(this),
         file_system_(this, PP_FILESYSTEMTYPE_LOCALPERSISTENT),
         file_system_ready_(false),
-        file_thread_(this) {}
+        file_queue_(this, kFileThreads) {}
 
-  virtual ~FileIoInstance() { file_thread_.Join(); }
+  virtual ~FileIoInstance() { file_queue_.Join(); }
 
   virtual bool Init(uint32_t /*argc*/,
                     const char * /*argn*/ [],
                     const char * /*argv*/ []) {
-    file_thread_.Start();
-    // Open the file system on the file_thread_. Since this is the first
-    // operation we perform there, and because we do everything on the
-    // file_thread_ synchronously, this ensures that the FileSystem is open
-    // before any FileIO operations execute.
-    file_thread_.message_loop().PostWork(
+    // Open the file system before anything else in the file_queue_. The work
+    // runs alone and everything posted later waits for it, so this ensures
+    // that the FileSystem is open before any FileIO operations execute.
+    file_queue_.PostExclusiveWork(
         callback_factory_.NewCallback(&FileIoInstance::OpenFileSystem));
+    file_queue_.Start();
     return true;
   }
 
@@ -79,31 +126,60 @@ class FileIoInstance : public pp::Instance {
   pp::CompletionCallbackFactory<FileIoInstance> callback_factory_;
   pp::FileSystem file_system_;
 
-  // Indicates whether file_system_ was opened successfully. We only read/write
-  // this on the file_thread_.
+  // Indicates whether file_system_ was opened successfully. Written once, by
+  // the first work of the file_queue_, before any other work runs.
   bool file_system_ready_;
 
-  // We do all our file operations on the file_thread_.
-  pp::SimpleThread file_thread_;
-
-  void PostArrayMessage(const char* command, const StringVector& strings) {
+  // We do all our file operations in the file_queue_: listings and loads go
+  // ahead of saves, and operations on one path run in the order they came.
+  FileWorkQueue file_queue_;
+
+  // A file operation asked for by the page.
+  struct FileRequest {
+    FileRequest() : id(kNoRequestId), offset(0), length(-1) {}
+    int32_t id;            // Chosen by the page, or kNoRequestId.
+    std::string command;
+    std::string path;
+    std::string argument;  // The text to save or the new name.
+    int64_t offset;        // Where a read starts.
+    int64_t length;        // Bytes to read, or -1 for the rest of the file.
+  };
+
+  // The requests of a "batch" message, run one after the other.
+  struct FileBatch {
+    FileBatch() : id(kNoRequestId), stop_on_error(false) {}
+    int32_t id;            // Of the batch, chosen by the page.
+    std::vector<FileRequest> requests;
+    bool stop_on_error;    // Skip the rest once a request fails.
+  };
+
+  // Posts [command, <request id>, strings...], leaving the id out of
+  // replies to requests that carry none.
+  void PostArrayMessage(const char* command,
+                        int32_t request_id,
+                        const StringVector& strings) {
     pp::VarArray message;
     message.Set(0, command);
+    uint32_t index = 1;
+    if (request_id != kNoRequestId)
+      message.Set(index++, request_id);
     for (size_t i = 0; i < strings.size(); ++i) {
-      message.Set(i + 1, strings[i]);
+      message.Set(index++, strings[i]);
     }
 
     PostMessage(message);
   }
 
-  void PostArrayMessage(const char* command) {
-    PostArrayMessage(command, StringVector());
+  void PostArrayMessage(const char* command, int32_t request_id) {
+    PostArrayMessage(command, request_id, StringVector());
   }
 
-  void PostArrayMessage(const char* command, const std::string& s) {
+  void PostArrayMessage(const char* command,
+                        int32_t request_id,
+                        const std::string& s) {
     StringVector sv;
     sv.push_back(s);
-    PostArrayMessage(command, sv);
+    PostArrayMessage(command, request_id, sv);
   }
 
   /// Handler for messages coming in from the browser via postMessage().  The
@@ -118,60 +194,195 @@ class FileIoInstance : public pp::Instance {
       return;
 
     // Message should be an array with the following elements:
-    // [command, path, extra args]
+    // [command, <request id>, path, extra args]
+    // The request id is optional.  If given, it is a number >= 0 that every
+    // reply to the request carries after its command, the last reply being
+    // [DONE, id, result].  Requests may then complete in any order.
+    // A "read" takes the offset and length of the range to stream, as in
+    // [read, id, path, offset, length]; both are optional, but the id is
+    // not.  The range comes back as [CHUNK, id, offset, file size,
+    // ArrayBuffer] replies, which the id tells from the numbers after it.
+    // A read without an id is refused with an ERR.
     pp::VarArray message(var_message);
-    std::string command = message.Get(0).AsString();
-    std::string file_name = message.Get(1).AsString();
+    FileRequest request;
+    request.command = message.Get(0).AsString();
+    uint32_t index = 1;
+    if (message.Get(1).is_int() && message.Get(1).AsInt() >= 0)
+      request.id = message.Get(index++).AsInt();
+    if (request.command == "batch") {
+      HandleBatch(request.id, message.Get(index), message.Get(index + 1));
+      return;
+    }
+    request.path = message.Get(index++).AsString();
+    if (message.Get(index).is_string())
+      request.argument = message.Get(index).AsString();
+    if (request.command == "read") {
+      request.offset = VarToInt64(message.Get(index), 0);
+      request.length = VarToInt64(message.Get(index + 1), -1);
+    }
 
-    if (file_name.length() == 0 || file_name[0] != '/') {
-      ShowStatusMessage("File name must begin with /");
+    if (request.path.length() == 0 || request.path[0] != '/') {
+      ShowStatusMessage(request.id, "File name must begin with /");
+      PostDone(request.id, PP_ERROR_BADARGUMENT);
+      return;
+    }
+    if (request.command == "read" && request.id == kNoRequestId) {
+      ShowErrorMessage(request.id, "read needs a request id",
+                       PP_ERROR_BADARGUMENT);
       return;
     }
 
-    printf("command: %s file_name: %s\n", command.c_str(), file_name.c_str());
-
-    if (command == "load") {
-      file_thread_.message_loop().PostWork(
-          callback_factory_.NewCallback(&FileIoInstance::Load, file_name));
-    } else if (command == "save") {
-      std::string file_text = message.Get(2).AsString();
-      file_thread_.message_loop().PostWork(callback_factory_.NewCallback(
-          &FileIoInstance::Save, file_name, file_text));
-    } else if (command == "delete") {
-      file_thread_.message_loop().PostWork(
-          callback_factory_.NewCallback(&FileIoInstance::Delete, file_name));
-    } else if (command == "list") {
-      const std::string& dir_name = file_name;
-      file_thread_.message_loop().PostWork(
-          callback_factory_.NewCallback(&FileIoInstance::List, dir_name));
-    } else if (command == "makedir") {
-      const std::string& dir_name = file_name;
-      file_thread_.message_loop().PostWork(
-          callback_factory_.NewCallback(&FileIoInstance::MakeDir, dir_name));
-    } else if (command == "rename") {
-      const std::string new_name = message.Get(2).AsString();
-      file_thread_.message_loop().PostWork(callback_factory_.NewCallback(
-          &FileIoInstance::Rename, file_name, new_name));
+    printf("command: %s file_name: %s\n",
+           request.command.c_str(),
+           request.path.c_str());
+
+    FileWorkQueue::Priority priority;
+    if (request.command == "load" || request.command == "read" ||
+        request.command == "list") {
+      priority = FileWorkQueue::kPriorityInteractive;
+    } else if (request.command == "save") {
+      priority = FileWorkQueue::kPriorityBulk;
+    } else if (request.command == "delete" || request.command == "makedir" ||
+               request.command == "rename") {
+      priority = FileWorkQueue::kPriorityNormal;
+    } else {
+      ShowErrorMessage(request.id, "Unknown command", PP_ERROR_BADARGUMENT);
+      PostDone(request.id, PP_ERROR_BADARGUMENT);
+      return;
+    }
+    pp::CompletionCallback callback =
+        callback_factory_.NewCallback(&FileIoInstance::RunRequest, request);
+    if (request.command == "rename") {
+      // Touches two paths; it runs alone, after everything before it.
+      file_queue_.PostExclusiveWork(callback);
+    } else {
+      file_queue_.PostWork(request.path, priority, callback);
     }
   }
 
+  // A batch message is [batch, <request id>, operations, stop on error],
+  // each operation being [command, path, extra args] as for a single
+  // request.  All operations run in one go; the reply is a single
+  // [BATCH, <id>, results], holding for each operation [result] or, for a
+  // load or a listing, [result, contents or names].  Operations skipped
+  // after an error, with stop on error set, have the result
+  // PP_ERROR_ABORTED.
+  void HandleBatch(int32_t request_id,
+                   const pp::Var& operations_var,
+                   const pp::Var& stop_on_error) {
+    if (!operations_var.is_array()) {
+      ShowErrorMessage(request_id, "Batch without operations",
+                       PP_ERROR_BADARGUMENT);
+      PostDone(request_id, PP_ERROR_BADARGUMENT);
+      return;
+    }
+    // Parsed here, so the file threads only see plain strings.
+    pp::VarArray operations(operations_var);
+    FileBatch batch;
+    batch.id = request_id;
+    batch.stop_on_error = stop_on_error.is_bool() && stop_on_error.AsBool();
+    for (uint32_t i = 0; i < operations.GetLength(); ++i) {
+      FileRequest request;
+      request.id = kBatchedRequestId;
+      if (operations.Get(i).is_array()) {
+        pp::VarArray operation(operations.Get(i));
+        if (operation.Get(0).is_string())
+          request.command = operation.Get(0).AsString();
+        if (operation.Get(1).is_string())
+          request.path = operation.Get(1).AsString();
+        if (operation.Get(2).is_string())
+          request.argument = operation.Get(2).AsString();
+      }
+      batch.requests.push_back(request);
+    }
+    // Its operations may touch any path; it runs alone, after everything
+    // before it, like a rename.
+    file_queue_.PostExclusiveWork(
+        callback_factory_.NewCallback(&FileIoInstance::RunBatch, batch));
+  }
+
+  void RunBatch(int32_t /* result */, const FileBatch& batch) {
+    pp::VarArray results;
+    int32_t batch_result = PP_OK;
+    for (size_t i = 0; i < batch.requests.size(); ++i) {
+      pp::VarArray entry;
+      pp::Var output;
+      int32_t result = PP_ERROR_ABORTED;
+      if (batch_result == PP_OK || !batch.stop_on_error)
+        result = RunOperation(batch.requests[i], &output);
+      entry.Set(0, result);
+      if (!output.is_undefined())
+        entry.Set(1, output);
+      results.Set(i, entry);
+      if (result != PP_OK && batch_result == PP_OK)
+        batch_result = result;
+    }
+
+    pp::VarArray message;
+    message.Set(0, "BATCH");
+    uint32_t index = 1;
+    if (batch.id != kNoRequestId)
+      message.Set(index++, batch.id);
+    message.Set(index, results);
+    PostMessage(message);
+    PostDone(batch.id, batch_result);
+  }
+
+  // Runs |request| on a file_queue_ thread and reports how it ended.
+  void RunRequest(int32_t /* result */, const FileRequest& request) {
+    PostDone(request.id, RunOperation(request, NULL));
+  }
+
+  // Runs |request| and returns PP_OK or the error met.  What a load or a
+  // listing finds goes to |output| if it is given, and to the page if not.
+  int32_t RunOperation(const FileRequest& request, pp::Var* output) {
+    if (request.path.length() == 0 || request.path[0] != '/') {
+      ShowStatusMessage(request.id, "File name must begin with /");
+      return PP_ERROR_BADARGUMENT;
+    }
+    int32_t result = PP_ERROR_BADARGUMENT;
+    if (request.command == "load") {
+      result = Load(request.id, request.path, output);
+    } else if (request.command == "read") {
+      // Its chunks go to the page as they are read; a batch has nowhere to
+      // keep them.
+      if (output)
+        return PP_ERROR_NOTSUPPORTED;
+      result = Read(request.id, request.path, request.offset, request.length);
+    } else if (request.command == "save") {
+      result = Save(request.id, request.path, request.argument);
+    } else if (request.command == "delete") {
+      result = Delete(request.id, request.path);
+    } else if (request.command == "list") {
+      const std::string& dir_name = request.path;
+      result = List(request.id, dir_name, output);
+    } else if (request.command == "makedir") {
+      const std::string& dir_name = request.path;
+      result = MakeDir(request.id, dir_name);
+    } else if (request.command == "rename") {
+      const std::string& new_name = request.argument;
+      result = Rename(request.id, request.path, new_name);
+    }
+    return result;
+  }
+
   void OpenFileSystem(int32_t /* result */) {
     int32_t rv = file_system_.Open(1024 * 1024, pp::BlockUntilComplete());
     if (rv == PP_OK) {
       file_system_ready_ = true;
       // Notify the user interface that we're ready
-      PostArrayMessage("READY");
+      PostArrayMessage("READY", kNoRequestId);
     } else {
-      ShowErrorMessage("Failed to open file system", rv);
+      ShowErrorMessage(kNoRequestId, "Failed to open file system", rv);
     }
   }
 
-  void Save(int32_t /* result */,
-            const std::string& file_name,
-            const std::string& file_contents) {
+  int32_t Save(int32_t request_id,
+               const std::string& file_name,
+               const std::string& file_contents) {
     if (!file_system_ready_) {
-      ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-      return;
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
     }
     pp::FileRef ref(file_system_, file_name.c_str());
     pp::FileIO file(this);
@@ -182,45 +393,36 @@ class FileIoInstance : public pp::Instance {
                       PP_FILEOPENFLAG_TRUNCATE,
                   pp::BlockUntilComplete());
     if (open_result != PP_OK) {
-      ShowErrorMessage("File open for write failed", open_result);
-      return;
+      ShowErrorMessage(request_id, "File open for write failed", open_result);
+      return open_result;
     }
 
     // We have truncated the file to 0 bytes. So we need only write if
     // file_contents is non-empty.
     if (!file_contents.empty()) {
-      if (file_contents.length() > INT32_MAX) {
-        ShowErrorMessage("File too big", PP_ERROR_FILETOOBIG);
-        return;
+      int32_t write_result = WriteFully(
+          &file, 0, file_contents.data(), file_contents.length());
+      if (write_result != PP_OK) {
+        ShowErrorMessage(request_id, "File write failed", write_result);
+        return write_result;
       }
-      int64_t offset = 0;
-      int32_t bytes_written = 0;
-      do {
-        bytes_written = file.Write(offset,
-                                   file_contents.data() + offset,
-                                   file_contents.length(),
-                                   pp::BlockUntilComplete());
-        if (bytes_written > 0) {
-          offset += bytes_written;
-        } else {
-          ShowErrorMessage("File write failed", bytes_written);
-          return;
-        }
-      } while (bytes_written < static_cast<int64_t>(file_contents.length()));
     }
     // All bytes have been written, flush the write buffer to complete
     int32_t flush_result = file.Flush(pp::BlockUntilComplete());
     if (flush_result != PP_OK) {
-      ShowErrorMessage("File fail to flush", flush_result);
-      return;
+      ShowErrorMessage(request_id, "File fail to flush", flush_result);
+      return flush_result;
     }
-    ShowStatusMessage("Save success");
+    ShowStatusMessage(request_id, "Save success");
+    return PP_OK;
   }
 
-  void Load(int32_t /* result */, const std::string& file_name) {
+  int32_t Load(int32_t request_id,
+               const std::string& file_name,
+               pp::Var* output) {
     if (!file_system_ready_) {
-      ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-      return;
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
     }
     pp::FileRef ref(file_system_, file_name.c_str());
     pp::FileIO file(this);
@@ -228,22 +430,22 @@ class FileIoInstance : public pp::Instance {
     int32_t open_result =
         file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete());
     if (open_result == PP_ERROR_FILENOTFOUND) {
-      ShowErrorMessage("File not found", open_result);
-      return;
+      ShowErrorMessage(request_id, "File not found", open_result);
+      return open_result;
     } else if (open_result != PP_OK) {
-      ShowErrorMessage("File open for read failed", open_result);
-      return;
+      ShowErrorMessage(request_id, "File open for read failed", open_result);
+      return open_result;
     }
     PP_FileInfo info;
     int32_t query_result = file.Query(&info, pp::BlockUntilComplete());
     if (query_result != PP_OK) {
-      ShowErrorMessage("File query failed", query_result);
-      return;
+      ShowErrorMessage(request_id, "File query failed", query_result);
+      return query_result;
     }
     // FileIO.Read() can only handle int32 sizes
     if (info.size > INT32_MAX) {
-      ShowErrorMessage("File too big", PP_ERROR_FILETOOBIG);
-      return;
+      ShowErrorMessage(request_id, "File too big", PP_ERROR_FILETOOBIG);
+      return PP_ERROR_FILETOOBIG;
     }
 
     std::vector<char> data(info.size);
@@ -260,88 +462,207 @@ class FileIoInstance : public pp::Instance {
         bytes_to_read -= bytes_read;
       } else if (bytes_read < 0) {
         // If bytes_read < PP_OK then it indicates the error code.
-        ShowErrorMessage("File read failed", bytes_read);
-        return;
+        ShowErrorMessage(request_id, "File read failed", bytes_read);
+        return bytes_read;
       }
     }
     // Done reading, send content to the user interface
     std::string string_data(data.begin(), data.end());
-    PostArrayMessage("DISP", string_data);
-    ShowStatusMessage("Load success");
+    if (output)
+      *output = pp::Var(string_data);
+    else
+      PostArrayMessage("DISP", request_id, string_data);
+    ShowStatusMessage(request_id, "Load success");
+    return PP_OK;
   }
 
-  void Delete(int32_t /* result */, const std::string& file_name) {
+  // Streams |length| bytes of |file_name| from |offset| (the rest of the
+  // file if |length| is negative) to the page, one
+  // [CHUNK, <id>, offset, file size, ArrayBuffer] message per
+  // kReadChunkBytes.  Each chunk is read straight into the buffer posted, so
+  // binary data arrives as is and only one chunk is held at a time.  Works
+  // on files of any size.
+  int32_t Read(int32_t request_id,
+               const std::string& file_name,
+               int64_t offset,
+               int64_t length) {
     if (!file_system_ready_) {
-      ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-      return;
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
+    }
+    if (offset < 0) {
+      ShowErrorMessage(request_id, "Negative offset", PP_ERROR_BADARGUMENT);
+      return PP_ERROR_BADARGUMENT;
+    }
+    pp::FileRef ref(file_system_, file_name.c_str());
+    pp::FileIO file(this);
+
+    int32_t open_result =
+        file.Open(ref, PP_FILEOPENFLAG_READ, pp::BlockUntilComplete());
+    if (open_result == PP_ERROR_FILENOTFOUND) {
+      ShowErrorMessage(request_id, "File not found", open_result);
+      return open_result;
+    } else if (open_result != PP_OK) {
+      ShowErrorMessage(request_id, "File open for read failed", open_result);
+      return open_result;
+    }
+    PP_FileInfo info;
+    int32_t query_result = file.Query(&info, pp::BlockUntilComplete());
+    if (query_result != PP_OK) {
+      ShowErrorMessage(request_id, "File query failed", query_result);
+      return query_result;
+    }
+
+    int64_t end = info.size;
+    if (length >= 0 && length < end - offset)
+      end = offset + length;
+    while (offset < end) {
+      int32_t chunk_size =
+          static_cast<int32_t>(std::min<int64_t>(kReadChunkBytes, end - offset));
+      pp::VarArrayBuffer chunk(chunk_size);
+      char* data = static_cast<char*>(chunk.Map());
+      if (!data) {
+        ShowErrorMessage(request_id, "Out of memory", PP_ERROR_NOMEMORY);
+        return PP_ERROR_NOMEMORY;
+      }
+      int32_t chunk_read = 0;
+      while (chunk_read < chunk_size) {
+        int32_t bytes_read = file.Read(offset + chunk_read,
+                                       data + chunk_read,
+                                       chunk_size - chunk_read,
+                                       pp::BlockUntilComplete());
+        if (bytes_read < 0) {
+          chunk.Unmap();
+          ShowErrorMessage(request_id, "File read failed", bytes_read);
+          return bytes_read;
+        }
+        if (bytes_read == 0)
+          break;  // The file got shorter since it was queried.
+        chunk_read += bytes_read;
+      }
+      if (chunk_read < chunk_size) {
+        // The only copy: the page must not see bytes that were never read.
+        pp::VarArrayBuffer rest(chunk_read);
+        char* rest_data = static_cast<char*>(rest.Map());
+        if (!rest_data && chunk_read > 0) {
+          chunk.Unmap();
+          ShowErrorMessage(request_id, "Out of memory", PP_ERROR_NOMEMORY);
+          return PP_ERROR_NOMEMORY;
+        }
+        std::copy(data, data + chunk_read, rest_data);
+        rest.Unmap();
+        chunk.Unmap();
+        chunk = rest;
+        end = offset + chunk_read;
+      } else {
+        chunk.Unmap();
+      }
+      if (chunk_read > 0)
+        PostChunk(request_id, offset, info.size, chunk);
+      offset += chunk_read;
+    }
+    ShowStatusMessage(request_id, "Read success");
+    return PP_OK;
+  }
+
+  void PostChunk(int32_t request_id,
+                 int64_t offset,
+                 int64_t file_size,
+                 const pp::VarArrayBuffer& chunk) {
+    // A read always has an id, see HandleMessage().
+    pp::VarArray message;
+    message.Set(0, "CHUNK");
+    message.Set(1, request_id);
+    // Doubles hold every offset up to 2^53 exactly.
+    message.Set(2, static_cast<double>(offset));
+    message.Set(3, static_cast<double>(file_size));
+    message.Set(4, chunk);
+    PostMessage(message);
+  }
+
+  int32_t Delete(int32_t request_id, const std::string& file_name) {
+    if (!file_system_ready_) {
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
     }
     pp::FileRef ref(file_system_, file_name.c_str());
 
     int32_t result = ref.Delete(pp::BlockUntilComplete());
     if (result == PP_ERROR_FILENOTFOUND) {
-      ShowStatusMessage("File/Directory not found");
-      return;
+      ShowStatusMessage(request_id, "File/Directory not found");
+      return result;
     } else if (result != PP_OK) {
-      ShowErrorMessage("Deletion failed", result);
-      return;
+      ShowErrorMessage(request_id, "Deletion failed", result);
+      return result;
     }
-    ShowStatusMessage("Delete success");
+    ShowStatusMessage(request_id, "Delete success");
+    return PP_OK;
   }
 
-  void List(int32_t /* result */, const std::string& dir_name) {
+  int32_t List(int32_t request_id,
+               const std::string& dir_name,
+               pp::Var* output) {
     if (!file_system_ready_) {
-      ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-      return;
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
     }
 
     pp::FileRef ref(file_system_, dir_name.c_str());
 
-    // Pass ref along to keep it alive.
-    ref.ReadDirectoryEntries(callback_factory_.NewCallbackWithOutput(
-        &FileIoInstance::ListCallback, ref));
-  }
-
-  void ListCallback(int32_t result,
-                    const std::vector<pp::DirectoryEntry>& entries,
-                    pp::FileRef /* unused_ref */) {
+    // Read in place, so later work on the directory waits for the listing.
+    pp::CompletionCallbackWithOutput<std::vector<pp::DirectoryEntry> >::
+        OutputStorageType entries;
+    int32_t result = ref.ReadDirectoryEntries(
+        pp::CompletionCallbackWithOutput<std::vector<pp::DirectoryEntry> >(
+            &entries));
     if (result != PP_OK) {
-      ShowErrorMessage("List failed", result);
-      return;
+      ShowErrorMessage(request_id, "List failed", result);
+      return result;
     }
 
     StringVector sv;
-    for (size_t i = 0; i < entries.size(); ++i) {
-      pp::Var name = entries[i].file_ref().GetName();
+    const std::vector<pp::DirectoryEntry>& entry_list = entries.output();
+    for (size_t i = 0; i < entry_list.size(); ++i) {
+      pp::Var name = entry_list[i].file_ref().GetName();
       if (name.is_string()) {
         sv.push_back(name.AsString());
       }
     }
-    PostArrayMessage("LIST", sv);
-    ShowStatusMessage("List success");
+    if (output) {
+      pp::VarArray names;
+      for (size_t i = 0; i < sv.size(); ++i)
+        names.Set(i, sv[i]);
+      *output = names;
+    } else {
+      PostArrayMessage("LIST", request_id, sv);
+    }
+    ShowStatusMessage(request_id, "List success");
+    return PP_OK;
   }
 
-  void MakeDir(int32_t /* result */, const std::string& dir_name) {
+  int32_t MakeDir(int32_t request_id, const std::string& dir_name) {
     if (!file_system_ready_) {
-      ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-      return;
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
     }
     pp::FileRef ref(file_system_, dir_name.c_str());
 
     int32_t result = ref.MakeDirectory(
         PP_MAKEDIRECTORYFLAG_NONE, pp::BlockUntilComplete());
     if (result != PP_OK) {
-      ShowErrorMessage("Make directory failed", result);
-      return;
+      ShowErrorMessage(request_id, "Make directory failed", result);
+      return result;
     }
-    ShowStatusMessage("Make directory success");
+    ShowStatusMessage(request_id, "Make directory success");
+    return PP_OK;
   }
 
-  void Rename(int32_t /* result */,
-              const std::string& old_name,
-              const std::string& new_name) {
+  int32_t Rename(int32_t request_id,
+                 const std::string& old_name,
+                 const std::string& new_name) {
     if (!file_system_ready_) {
-      ShowErrorMessage("File system is not open", PP_ERROR_FAILED);
-      return;
+      ShowErrorMessage(request_id, "File system is not open", PP_ERROR_FAILED);
+      return PP_ERROR_FAILED;
     }
 
     pp::FileRef ref_old(file_system_, old_name.c_str());
@@ -349,21 +670,40 @@ class FileIoInstance : public pp::Instance {
 
     int32_t result = ref_old.Rename(ref_new, pp::BlockUntilComplete());
     if (result != PP_OK) {
-      ShowErrorMessage("Rename failed", result);
-      return;
+      ShowErrorMessage(request_id, "Rename failed", result);
+      return result;
     }
-    ShowStatusMessage("Rename success");
+    ShowStatusMessage(request_id, "Rename success");
+    return PP_OK;
   }
 
   /// Encapsulates our simple javascript communication protocol
-  void ShowErrorMessage(const std::string& message, int32_t result) {
+  void ShowErrorMessage(int32_t request_id,
+                        const std::string& message,
+                        int32_t result) {
+    if (request_id == kBatchedRequestId)
+      return;
     std::stringstream ss;
     ss << message << " -- Error #: " << result;
-    PostArrayMessage("ERR", ss.str());
+    PostArrayMessage("ERR", request_id, ss.str());
   }
 
-  void ShowStatusMessage(const std::string& message) {
-    PostArrayMessage("STAT", message);
+  void ShowStatusMessage(int32_t request_id, const std::string& message) {
+    if (request_id == kBatchedRequestId)
+      return;
+    PostArrayMessage("STAT", request_id, message);
+  }
+
+  // Ends a request with its result: PP_OK or the error met.  Requests without
+  // an id get no DONE, as before ids were introduced.
+  void PostDone(int32_t request_id, int32_t result) {
+    if (request_id == kNoRequestId || request_id == kBatchedRequestId)
+      return;
+    pp::VarArray message;
+    message.Set(0, "DONE");
+    message.Set(1, request_id);
+    message.Set(2, result);
+    PostMessage(message);
   }
 };
 
@@ -0,0 +1,180 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ppapi/c/pp_errors.h"
+
+#include "file_work_queue.h"
+
+namespace {
+  const int kMinThreads = 1;
+}
+
+struct FileWorkQueue::Work {
+  Work(const std::string& work_key, Priority work_priority,
+      bool work_exclusive, const pp::CompletionCallback& work_callback)
+  : key(work_key), priority(work_priority), exclusive(work_exclusive),
+    callback(work_callback) {}
+
+  std::string key;
+  Priority priority;
+  bool exclusive;
+  pp::CompletionCallback callback;
+};
+
+struct FileWorkQueue::Worker {
+  Worker(FileWorkQueue* worker_queue, const pp::InstanceHandle& instance)
+  : queue(worker_queue), thread(instance), work(NULL) {}
+
+  FileWorkQueue* queue;
+  pp::SimpleThread thread;
+  Work* work;  // Running on |thread|, or NULL if it is idle.
+};
+
+FileWorkQueue::FileWorkQueue(const pp::InstanceHandle& instance,
+    int thread_count)
+: started_(false),
+  stopping_(false),
+  running_count_(0),
+  exclusive_running_(false) {
+  pthread_mutex_init(&lock_, NULL);
+  if (thread_count < kMinThreads)
+    thread_count = kMinThreads;
+  for (int i = 0; i < thread_count; i++)
+    workers_.push_back(new Worker(this, instance));
+}
+
+FileWorkQueue::~FileWorkQueue() {
+  Join();
+  for (size_t i = 0; i < workers_.size(); i++)
+    delete workers_[i];
+  pthread_mutex_destroy(&lock_);
+}
+
+void FileWorkQueue::Join() {
+  pthread_mutex_lock(&lock_);
+  if (stopping_) {
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+  stopping_ = true;
+  std::deque<Work*> pending;
+  pending.swap(pending_);
+  pthread_mutex_unlock(&lock_);
+  if (!started_) {
+    for (size_t i = 0; i < pending.size(); i++)
+      delete pending[i];
+    return;
+  }
+  // Nothing is dispatched any more, so once the other threads are joined
+  // the only work left running is on the first one.  What is still waiting
+  // is queued after it, in the order it was posted, and runs one at a time
+  // as it would have on a single file thread: per-key order and exclusive
+  // work still hold.
+  for (size_t i = 1; i < workers_.size(); i++)
+    workers_[i]->thread.Join();
+  for (size_t i = 0; i < pending.size(); i++) {
+    workers_[0]->thread.message_loop().PostWork(pending[i]->callback);
+    delete pending[i];
+  }
+  workers_[0]->thread.Join();
+}
+
+void FileWorkQueue::Start() {
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i]->thread.Start();
+  pthread_mutex_lock(&lock_);
+  started_ = true;
+  Dispatch();
+  pthread_mutex_unlock(&lock_);
+}
+
+int32_t FileWorkQueue::PostWork(const std::string& key, Priority priority,
+    const pp::CompletionCallback& callback) {
+  return Post(new Work(key, priority, false, callback));
+}
+
+int32_t FileWorkQueue::PostExclusiveWork(
+    const pp::CompletionCallback& callback) {
+  return Post(new Work(std::string(), kPriorityInteractive, true, callback));
+}
+
+int32_t FileWorkQueue::Post(Work* work) {
+  pthread_mutex_lock(&lock_);
+  if (stopping_) {
+    pthread_mutex_unlock(&lock_);
+    delete work;
+    return PP_ERROR_ABORTED;
+  }
+  pending_.push_back(work);
+  Dispatch();
+  pthread_mutex_unlock(&lock_);
+  return PP_OK;
+}
+
+void FileWorkQueue::Dispatch() {
+  if (!started_ || stopping_)
+    return;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker* worker = workers_[i];
+    if (worker->work)
+      continue;
+    Work* work = TakeNext();
+    if (!work)
+      return;
+    worker->work = work;
+    running_count_++;
+    if (work->exclusive)
+      exclusive_running_ = true;
+    else
+      running_keys_.insert(work->key);
+    worker->thread.message_loop().PostWork(
+        pp::CompletionCallback(&FileWorkQueue::RunWork, worker));
+  }
+}
+
+FileWorkQueue::Work* FileWorkQueue::TakeNext() {
+  if (exclusive_running_)
+    return NULL;
+  // Keys met earlier in pending_: only the oldest work of a key may start.
+  std::set<std::string> seen_keys;
+  std::deque<Work*>::iterator next = pending_.end();
+  for (std::deque<Work*>::iterator it = pending_.begin();
+      it != pending_.end(); ++it) {
+    Work* work = *it;
+    if (work->exclusive) {
+      // Nothing posted after it may pass it.
+      if (it == pending_.begin() && running_count_ == 0)
+        next = it;
+      break;
+    }
+    if (!seen_keys.insert(work->key).second || running_keys_.count(work->key))
+      continue;
+    if (next == pending_.end() || work->priority < (*next)->priority)
+      next = it;
+  }
+  if (next == pending_.end())
+    return NULL;
+  Work* work = *next;
+  pending_.erase(next);
+  return work;
+}
+
+// static
+void FileWorkQueue::RunWork(void* user_data, int32_t result) {
+  Worker* worker = static_cast<Worker*>(user_data);
+  FileWorkQueue* queue = worker->queue;
+  Work* work = worker->work;
+  work->callback.Run(result);
+
+  pthread_mutex_lock(&queue->lock_);
+  worker->work = NULL;
+  queue->running_count_--;
+  if (work->exclusive)
+    queue->exclusive_running_ = false;
+  else
+    queue->running_keys_.erase(work->key);
+  queue->Dispatch();
+  pthread_mutex_unlock(&queue->lock_);
+  delete work;
+}